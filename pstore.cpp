@@ -9,7 +9,8 @@
   global namespace of Antelope 64-bit names. File names are first-come, first-serve.
 
   Once a file is created by its owner account, the owner can set data nodes (parts)
-  on it, starting from node 0 and onwards (data node IDs must be contiguous).
+  on it, starting from node 0 and onwards (data node IDs must be contiguous, unless
+  the file is sparse, see setsparse).
 
   Once the data upload is done, the file can be flagged as published (ready).
   Published files can also be set to immutable.
@@ -29,6 +30,9 @@
 */
 
 #include <eosio/eosio.hpp>
+#include <eosio/crypto.hpp>
+#include <eosio/singleton.hpp>
+#include <eosio/system.hpp>
 
 using namespace eosio;
 
@@ -42,21 +46,257 @@ public:
   struct [[eosio::table]] file {
     name                    owner;      // account that controls the file (0 == no one / immutable)
     uint32_t                top;        // first empty node after last data node
-    bool                    published;  // if the file is ready for use
+    bool                    published;  // if the file is ready for use (not while a commit is merged, see commit)
+    binary_extension<uint8_t> status;   // FILE_READY, or FILE_RESETTING/FILE_DELETING while gc clears nodes
+    binary_extension<uint32_t> reserved; // node count declared by reserve (0 == not reserved)
+    binary_extension<uint32_t> arrived; // number of reserved nodes written so far
+    binary_extension<uint64_t> total_bytes; // sum of the data sizes of all nodes (of those below uncounted)
+    binary_extension<checksum256> root; // Merkle root of the node hashes, once published and hashed (see merkle)
+    binary_extension<name> base;        // file this file was cloned from (see clone)
+    binary_extension<uint32_t> shared;  // nodes below this that the file lacks are read from base
+    binary_extension<vector<unsigned char>> inline_data; // data of node 0 of an inline file (see set_inline)
+    binary_extension<uint8_t> staged;   // generation of the file's pending stage (0 == none, see stage)
+    binary_extension<uint8_t> overlay;  // generation of a committed stage that gc still has to merge
+    binary_extension<uint8_t> index_gen; // generation whose scope holds the byte offset index
+    binary_extension<bool> sparse;      // node ids are spaced out for insertnode (see setsparse)
+    binary_extension<uint64_t> stale_offsets; // first node id whose byte offset index record may be off (0 == none, see index_node)
+    binary_extension<uint64_t> uncounted; // first node id whose size total_bytes doesn't count yet (BYTES_COUNTED == none, see count_bytes)
     uint64_t primary_key() const { return 0; }
   };
 
   typedef eosio::multi_index< "files"_n, file > files;
 
   // Node table is scoped by file name, record indexed by node id.
+  // A node either holds its own data, or has empty data and references a shared blob, or
+  //   has empty data and no blob (blob == 0) and is virtual: a hole of zeros (see sethole)
+  //   or a reference to bytes of another file (see setrefnode).
   struct [[eosio::table]] node {
     uint64_t                id;
     vector<unsigned char>   data;
+    binary_extension<uint64_t> blob;    // id of the blob holding the data if data is empty
+    binary_extension<uint32_t> hole;    // data size of a virtual node (zeros unless it has a source)
+    binary_extension<name>  source;     // file whose bytes a reference node holds
+    binary_extension<uint64_t> source_offset; // offset of those bytes within source
     uint64_t primary_key() const { return id; }
   };
 
   typedef eosio::multi_index< "nodes"_n, node > nodes;
 
+  // Arrival bitmap of a reserved file, scoped by file name.
+  // Bit (nodeid % 64) of the record with id (nodeid / 64) is set once that node is written.
+  struct [[eosio::table]] bitmap {
+    uint64_t                id;
+    uint64_t                bits;
+    uint64_t primary_key() const { return id; }
+  };
+
+  typedef eosio::multi_index< "bitmaps"_n, bitmap > bitmaps;
+
+  // Uploaders of a file, scoped by file name, record indexed by account (see adduploader).
+  struct [[eosio::table]] uploader {
+    name                    account;
+    uint64_t                first;      // first node id the uploader can set
+    uint64_t                end;        // node id past the last node the uploader can set
+    uint64_t primary_key() const { return account.value; }
+  };
+
+  typedef eosio::multi_index< "uploaders"_n, uploader > uploaders;
+
+  // Payers of the node rows of a stage that its owner doesn't pay for, scoped by the stage's
+  //   name (see stage), record indexed by node id. Lets merge_stage move an uploader's rows
+  //   (see adduploader) to the file's scope without billing the owner.
+  struct [[eosio::table]] row_payer {
+    uint64_t                id;         // node id
+    name                    payer;
+    uint64_t primary_key() const { return id; }
+  };
+
+  typedef eosio::multi_index< "payers"_n, row_payer > row_payers;
+
+  // Byte offset index of a file's nodes, record indexed by node id. Scoped by file name,
+  //   or by file name | file::index_gen for a file that has committed a stage.
+  // Records exist for a run of nodes starting at node 0 (see index_nodes). The node that
+  //   holds byte X of the file is the one with the greatest offset not past X, e.g. with
+  //   a reverse get_table_rows query on the "byoffset" index with upper_bound X and limit 1.
+  // Writes keep the index up to date, except that a node size change moves at most
+  //   INDEX_WRITE_LIMIT later offsets (see index_node): while file::stale_offsets is not 0,
+  //   the offsets of the records from that node id on are off until reindex moves them,
+  //   and readers should only trust the records below it.
+  // Records also keep the sha256 of each node's data, the leaves of the file's Merkle tree.
+  struct [[eosio::table]] node_offset {
+    uint64_t                id;         // node id
+    uint64_t                offset;     // offset of the node's first data byte within the file
+    uint32_t                size;       // node data size
+    checksum256             hash;       // sha256 of the node data
+    uint64_t primary_key() const { return id; }
+    uint64_t by_offset() const { return offset; }
+  };
+
+  typedef eosio::multi_index< "offsets"_n, node_offset,
+    indexed_by<"byoffset"_n, const_mem_fun<node_offset, uint64_t, &node_offset::by_offset> >
+    > offsets;
+
+  // Progress of the Merkle root of a published file, scoped by file name, record is a singleton.
+  // The leaves hashed so far make up perfect subtrees whose sizes are the bits of leaves,
+  //   largest first, and frontier holds their roots (see merkle_push).
+  struct [[eosio::table]] merkle_state {
+    uint64_t                next;       // node id from which nodes are still to be hashed
+    uint64_t                leaves;     // number of nodes hashed so far
+    vector<checksum256>     frontier;   // roots of the perfect subtrees of the hashed nodes
+    uint64_t                first;      // node id of the first leaf of the last subtree of MERKLE_SUBTREE_HEIGHT begun
+    uint64_t primary_key() const { return 0; }
+  };
+
+  typedef eosio::multi_index< "merkles"_n, merkle_state > merkles;
+
+  // Kept roots of the Merkle tree of a published file, scoped by file name, record indexed
+  //   by height << 32 | index: the root of the perfect subtree of the leaves from
+  //   index << height up to (index + 1) << height, for each height from
+  //   MERKLE_SUBTREE_HEIGHT up, so that proof reads O(log n) records (see merkle_push).
+  // Records are overwritten as a new root is hashed; any past the file's leaves are left
+  //   over from an earlier root, and erased with the file's nodes.
+  struct [[eosio::table]] subtree {
+    uint64_t                id;
+    uint64_t                first;      // node id of the first leaf (of a subtree of MERKLE_SUBTREE_HEIGHT, else 0)
+    checksum256             hash;       // root of the subtree
+    uint64_t primary_key() const { return id; }
+  };
+
+  typedef eosio::multi_index< "subtrees"_n, subtree > subtrees;
+
+  // Shared blob store, scope is the contract, record indexed by blob id (starting at 1).
+  // A blob is stored once per distinct content and account, found by the sha256 of the
+  //   account and the sha256 of its data (see key), and freed when the last node that references it is overwritten or cleared.
+  // The account that uploads a blob pays for its RAM, and only nodes written by that same
+  //   account share it, so that no account can keep another's RAM in use.
+  struct [[eosio::table]] blob {
+    uint64_t                id;
+    name                    payer;      // account that pays for the blob and whose nodes share it
+    checksum256             hash;       // sha256 of the blob data
+    uint32_t                size;       // blob data size
+    uint64_t                refs;       // number of nodes that reference the blob
+    uint64_t primary_key() const { return id; }
+    checksum256 by_key() const { return key( payer, hash ); }
+
+    // Secondary key of the blob of account payer with data hash hash: the sha256 of the
+    //   account name followed by the hash, so that a single find gives the account's blob.
+    static checksum256 key( name payer, const checksum256 & hash ) {
+      std::array<uint8_t, 40> bytes;
+      auto hbytes = hash.extract_as_byte_array();
+      memcpy( bytes.data(), &payer.value, sizeof(payer.value) );
+      std::copy( hbytes.begin(), hbytes.end(), bytes.begin() + sizeof(payer.value) );
+      return sha256( reinterpret_cast<const char*>( bytes.data() ), bytes.size() );
+    }
+  };
+
+  typedef eosio::multi_index< "blobs"_n, blob,
+    indexed_by<"bykey"_n, const_mem_fun<blob, checksum256, &blob::by_key> >
+    > blobs;
+
+  // Blob data, scope is the contract, record indexed by blob id.
+  // Kept apart from the blobs table so that counting references never loads the data.
+  struct [[eosio::table]] blob_data {
+    uint64_t                id;
+    vector<unsigned char>   data;
+    uint64_t primary_key() const { return id; }
+  };
+
+  typedef eosio::multi_index< "blobdata"_n, blob_data > blob_data_table;
+
+  // Registry of all files, scope is the contract, record indexed by file name.
+  // Lists the files of an owner, or the files changed since some block, with one
+  //   get_table_rows query on the "byowner" or "bymodified" index. Files are added on
+  //   create, and files that predate the registry on their next change (or with regfile).
+  struct [[eosio::table]] registry_entry {
+    name                    filename;
+    name                    owner;      // file::owner
+    uint32_t                modified;   // block number of the file's last change
+    uint64_t primary_key() const { return filename.value; }
+    uint64_t by_owner() const { return owner.value; }
+    uint64_t by_modified() const { return modified; }
+  };
+
+  typedef eosio::multi_index< "registry"_n, registry_entry,
+    indexed_by<"byowner"_n, const_mem_fun<registry_entry, uint64_t, &registry_entry::by_owner> >,
+    indexed_by<"bymodified"_n, const_mem_fun<registry_entry, uint64_t, &registry_entry::by_modified> >
+    > registry;
+
+  // Change feed, scope is the contract, record indexed by sequence number.
+  // Every change to a file (but not to its stage) appends a record, and the oldest records
+  //   are pruned past the latest config::feed_window. A mirror stays in sync by reading
+  //   the records after the last sequence number it has seen, and the files they name.
+  struct [[eosio::table]] change {
+    uint64_t                seq;
+    name                    filename;
+    uint8_t                 kind;       // CHANGE_CREATE, CHANGE_SETNODE, ...
+    uint64_t                nodeid;     // node set, inserted or popped by CHANGE_SETNODE/CHANGE_INSERTNODE/CHANGE_DELNODE
+    uint32_t                count;      // number of nodes from nodeid on that a CHANGE_SETNODE sets, in node id order (1 otherwise)
+    uint64_t primary_key() const { return seq; }
+  };
+
+  typedef eosio::multi_index< "changes"_n, change > changes;
+
+  // Contract configuration, scope is the contract.
+  struct [[eosio::table]] config {
+    uint32_t                inline_max; // largest node 0 that a single-node file keeps inline
+    binary_extension<uint32_t> feed_window; // number of change feed records kept (0 == feed off)
+    binary_extension<vector<name>> subscribers; // accounts notified of setpub, commit, setimmutable and del
+  };
+
+  typedef eosio::singleton< "config"_n, config > config_table;
+
+  // Operation of a delta (see appenddelta): copy length bytes of the source file starting
+  //   at offset if data is empty, or else insert data.
+  struct delta_op {
+    uint64_t                offset;
+    uint32_t                length;
+    vector<unsigned char>   data;
+  };
+
+  // Result of the stat query.
+  struct file_stat {
+    name                    owner;
+    uint32_t                top;
+    bool                    published;
+    vector<uint32_t>        sizes;      // data size of each node below top (0 == missing node)
+    vector<uint64_t>        ids;        // node id of each entry of sizes, for a sparse file only
+  };
+
+  /*
+    Set the contract configuration. Only the contract account can do this.
+    inline_max: files whose only node holds at most this many bytes keep it in their file
+      row (see set_inline); 0 (the default) disables inline storage for new writes. Inline
+      files have no nodes table rows, so only enable it once the readers of the contract's
+      tables (gateways, download tools) read file::inline_data too.
+    feed_window: number of most recent change feed records kept; 0 stops recording changes.
+   */
+  [[eosio::action]]
+  void setconfig( uint32_t inline_max, uint32_t feed_window ) {
+    require_auth( _self );
+    config_table cfg( _self, _self.value );
+    config c = get_config();
+    c.inline_max = inline_max;
+    c.feed_window.emplace( feed_window );
+    cfg.set( c, _self );
+  }
+
+  /*
+    Set the accounts that setpub, commit, setimmutable and del notify (with
+      require_recipient), so that contracts and indexers can react to them from action
+      traces instead of polling the files table. Only the contract account can do this.
+   */
+  [[eosio::action]]
+  void setsubs( vector<name> subscribers ) {
+    require_auth( _self );
+    check( subscribers.size() <= MAX_SUBSCRIBERS, "Too many subscribers." );
+    for ( name sub : subscribers )
+      check( is_account( sub ), "Subscriber account does not exist." );
+    config_table cfg( _self, _self.value );
+    config c = get_config();
+    c.subscribers.emplace( subscribers );
+    cfg.set( c, _self );
+  }
+
   /*
     Create a new file.
 
@@ -97,44 +337,297 @@ public:
       p.owner = owner;
       p.top = 0;
       p.published = false;
+      extend( p );
+      p.total_bytes.emplace( 0 );
+    });
+    touch( owner, filename, owner );
+    log_change( owner, filename, CHANGE_CREATE );
+  }
+
+  /*
+    Add a file that predates the registry to it. Anyone can call this, and payer pays
+      for the RAM of the registry record.
+  */
+  [[eosio::action]]
+  void regfile( name payer, name filename ) {
+    require_auth( payer );
+    check_file_name( filename );
+    files fls( _self, filename.value );
+    files::const_iterator pit = fls.begin();
+    check( pit != fls.end(), "File does not exist." );
+    registry reg( _self, _self.value );
+    check( reg.find( filename.value ) == reg.end(), "File already registered." );
+    touch( payer, filename, pit->owner );
+  }
+
+  /*
+    Create file dst (same rules as create) as a copy of file src, without copying any data.
+    dst shares all of src's nodes and reads them from src until they are written to, so a
+      new version of a file costs RAM for the nodes that differ only. src must be immutable,
+      so that the shared nodes never change.
+    dst's byte offset index is built from src's with reindex.
+   */
+  [[eosio::action]]
+  void clone( name owner, name src, name dst ) {
+    check_file_name( src );
+    files srcs( _self, src.value );
+    files::const_iterator sit = srcs.begin();
+    check( sit != srcs.end(), "File does not exist." );
+    check( sit->owner == name(), "Source file not immutable." );
+    check( sit->overlay.value_or( 0 ) == 0, "Commit being merged." );
+    create( owner, dst );
+    files fls( _self, dst.value );
+    fls.modify( fls.begin(), same_payer, [&]( auto& p ) {
+      p.top = sit->top;
+      extend( p );
+      p.total_bytes.emplace( file_bytes( *sit ) );
+      p.uncounted.emplace( uncounted_node( *sit ) );
+      p.sparse.emplace( is_sparse( *sit ) );
+      if ( is_inline( *sit ) ) {
+	p.inline_data.emplace( sit->inline_data.value() );
+      } else {
+	p.base.emplace( src );
+	p.shared.emplace( sit->top );
+      }
     });
+    log_change( owner, dst, CHANGE_CLONE );
   }
 
   /*
     Reset file data.
+    If the file has more than CLEAR_NODES_LIMIT nodes, it is left in FILE_RESETTING status
+      and gc must be called until all nodes are cleared before the file can be used again.
    */
   [[eosio::action]]
   void reset( name owner, name filename ) {
     files fls( _self, filename.value );
     files::const_iterator pit = auth_and_find_file( owner, filename, fls );
+    check_unstaged( *pit );
+    log_change( owner, filename, CHANGE_RESET );
+    bool cleared = clear_nodes( filename, CLEAR_NODES_LIMIT );
     fls.modify( pit, same_payer, [&]( auto& p ) {
       p.top = 0;
       p.published = false;
+      extend( p );
+      p.total_bytes.emplace( 0 );
+      p.uncounted.emplace( BYTES_COUNTED );
+      p.reserved.emplace( 0 );
+      p.arrived.emplace( 0 );
+      p.base.emplace( name() );
+      p.shared.emplace( 0 );
+      p.inline_data.value().clear();
+      p.sparse.emplace( false );
+      p.stale_offsets.emplace( 0 );
+      if ( ! cleared )
+	p.status.emplace( FILE_RESETTING );
     });
-    clear_nodes( filename );
   }
 
   /*
     Delete file.
+    If the file has more than CLEAR_NODES_LIMIT nodes, it is left in FILE_DELETING status
+      and gc must be called until all nodes are cleared, which then erases the file.
   */
   [[eosio::action]]
   void del( name owner, name filename ) {
     files fls( _self, filename.value );
     files::const_iterator pit = auth_and_find_file( owner, filename, fls );
-    fls.erase( pit );
-    clear_nodes( filename );
+    check_unstaged( *pit );
+    log_change( owner, filename, CHANGE_DEL );
+    notify_subscribers();
+    if ( clear_nodes( filename, CLEAR_NODES_LIMIT ) ) {
+      fls.erase( pit );
+      unregister( filename );
+    } else {
+      fls.modify( pit, same_payer, [&]( auto& p ) {
+	p.published = false;
+	p.status.emplace( FILE_DELETING );
+      });
+    }
+  }
+
+  /*
+    Clear up to max_rows nodes of a file that is being reset or deleted, or of a dropped
+      stage (see unstage, which gives the stage's name), or merge up to max_rows nodes of
+      a committed stage into its file (see commit).
+    Anyone can call this, as it only continues work already requested by the file owner.
+    Each call picks up where the previous one left off; once no nodes are left, a reset
+      file becomes usable again, a deleted file or dropped stage is erased, and a file
+      whose commit is merged is published, and can be changed and staged again.
+  */
+  [[eosio::action]]
+  void gc( name filename, uint32_t max_rows ) {
+    check( max_rows > 0, "Invalid max_rows." );
+    files fls( _self, filename.value );
+    files::const_iterator pit = fls.begin();
+    check( pit != fls.end(), "File does not exist." );
+    uint8_t status = pit->status.value_or( FILE_READY );
+    if ( status == FILE_READY ) {
+      check( pit->overlay.value_or( 0 ) != 0, "File not being cleared." );
+      merge_stage( fls, pit, filename, max_rows );
+      return;
+    }
+    if ( ! clear_nodes( filename, max_rows ) )
+      return;
+    if ( status == FILE_DELETING ) {
+      fls.erase( pit );
+      unregister( filename );
+    } else {
+      fls.modify( pit, same_payer, [&]( auto& p ) {
+	p.status.emplace( FILE_READY );
+      });
+    }
   }
 
   /*
     Modify the file's published flag.
+    A reserved file can only be published once all of its reserved nodes have been written.
+    Publishing starts the file's Merkle root, and hashes the first MERKLE_NODES_LIMIT nodes
+      into it; merkle hashes the rest of a larger file.
+    Subscribers (see setsubs) are notified.
    */
   [[eosio::action]]
   void setpub( name owner, name filename, bool ispub ) {
     files fls( _self, filename.value );
     files::const_iterator pit = auth_and_find_file( owner, filename, fls );
+    check( pit->overlay.value_or( 0 ) == 0, "Commit being merged." );
+    if ( ispub )
+      check( pit->arrived.value_or( 0 ) == pit->reserved.value_or( 0 ), "Missing reserved nodes." );
+    log_change( owner, filename, CHANGE_SETPUB );
+    notify_subscribers();
     fls.modify( pit, same_payer, [&]( auto& p ) {
       p.published = ispub;
+      if ( ispub ) {
+	extend( p );
+	p.root.emplace( checksum256() );
+      }
     });
+    drop_merkle( filename );
+    if ( ispub )
+      merkle_step( fls, pit, owner, filename, merkle_state{}, MERKLE_NODES_LIMIT );
+  }
+
+  /*
+    Hash up to max_rows more nodes of a published file into its Merkle root, from where
+      setpub, commit or the last call left off, or from the start for a commit that gc
+      merged. Once every node is hashed, file::root is set and proof can be queried.
+    Anyone can call it, and payer pays for the RAM of the file's Merkle progress record,
+      and of the subtree roots it keeps (see subtree).
+   */
+  [[eosio::action]]
+  void merkle( name payer, name filename, uint32_t max_rows ) {
+    require_auth( payer );
+    check( max_rows > 0, "Invalid max_rows." );
+    check_file_name( filename );
+    files fls( _self, filename.value );
+    files::const_iterator pit = fls.begin();
+    check( pit != fls.end(), "File does not exist." );
+    check( pit->published, "File not published." );
+    merkles mks( _self, filename.value );
+    auto mit = mks.begin();
+    merkle_state m{};
+    if ( mit == mks.end() ) {
+      check( pit->root.has_value(), "Merkle root not started." );
+    } else {
+      check( mit->next < pit->top, "Merkle root done." );
+      m = *mit;
+      mks.erase( mit );
+    }
+    merkle_step( fls, pit, payer, filename, m, max_rows );
+  }
+
+  /*
+    Read-only query for the Merkle proof of a node of a published file: the hashes of the
+      sibling subtrees on the path from the node's leaf up to the root, bottom-up.
+    A leaf is the sha256 of a 0x00 byte followed by the sha256 of the node's data, and the
+      subtree above two hashes the sha256 of a 0x01 byte followed by both (see merkle_leaf
+      and merkle_node). A level where the node's subtree has no sibling (see merkle_level)
+      contributes no hash.
+    Only the leaves of the node's subtree of MERKLE_SUBTREE_HEIGHT are hashed; the hashes
+      above it come from the subtree roots kept by merkle_step (see subtree).
+   */
+  [[eosio::action, eosio::read_only]]
+  vector<checksum256> proof( name filename, uint64_t nodeid ) {
+    files fls( _self, filename.value );
+    files::const_iterator pit = fls.begin();
+    check( pit != fls.end(), "File does not exist." );
+    check( pit->published, "File not published." );
+    merkles mks( _self, filename.value );
+    auto mit = mks.begin();
+    check( mit != mks.end() && mit->next >= pit->top, "Merkle root pending." );
+    check( nodeid < pit->top, "Past top." );
+    vector<checksum256> path;
+    if ( is_inline( *pit ) )
+      return path;
+    uint64_t leaves = mit->leaves;
+    uint64_t leaf = merkle_position( *pit, filename, nodeid, leaves );
+    vector<checksum256> level = merkle_block( *pit, filename, leaf >> MERKLE_SUBTREE_HEIGHT, leaves );
+    for ( uint64_t i = leaf & ( MERKLE_SUBTREE_LEAVES - 1 ); level.size() > 1; i /= 2 ) {
+      uint64_t sibling = i ^ 1;
+      if ( sibling < level.size() )
+	path.push_back( level[sibling] );
+      merkle_level( level );
+    }
+    for ( uint32_t height = MERKLE_SUBTREE_HEIGHT; ( leaves - 1 ) >> height > 0; ++height ) {
+      uint64_t first = ( ( leaf >> height ) ^ 1 ) << height;
+      if ( first < leaves )
+	path.push_back( merkle_range( *pit, filename, first, std::min( first + ( uint64_t(1) << height ), leaves ), leaves ) );
+    }
+    return path;
+  }
+
+  /*
+    Read-only query for up to length bytes of a file's data, starting at byte offset.
+    Returns fewer bytes if the range runs past the end of the file (or into a node that a
+      reserved file doesn't have yet). The first node is found through the byte offset index.
+    The chain's max_action_return_value_size limits how much can be read in one call.
+   */
+  [[eosio::action, eosio::read_only]]
+  vector<char> readrange( name filename, uint64_t offset, uint32_t length ) {
+    return read_range( filename, offset, length );
+  }
+
+  /*
+    Read-only query for a file's metadata and the data size of each of its nodes, so that
+      downloads can be planned without fetching the nodes themselves. For a sparse file
+      (see setsparse), sizes lists the nodes it has in node id order, and ids their ids.
+   */
+  [[eosio::action, eosio::read_only]]
+  file_stat stat( name filename ) {
+    files fls( _self, filename.value );
+    files::const_iterator pit = fls.begin();
+    check( pit != fls.end(), "File does not exist." );
+    file_stat fs{ pit->owner, pit->top, pit->published };
+    if ( is_inline( *pit ) ) {
+      fs.sizes.push_back( pit->inline_data.value().size() );
+      return fs;
+    }
+    name store = live_store( *pit, filename );
+    offsets ofs( _self, index_scope( *pit, filename ) );
+    if ( is_sparse( *pit ) ) {
+      uint64_t nodeid = 0;
+      for ( auto oit = ofs.begin(); oit != ofs.end() && oit->id < pit->top; ++oit ) {
+	fs.ids.push_back( oit->id );
+	fs.sizes.push_back( oit->size );
+	nodeid = oit->id + 1;
+      }
+      for ( ;; ++nodeid ) {
+	int32_t itr = find_next_node_row( store, nodeid, true );
+	if ( itr < 0 )
+	  break;
+	fs.ids.push_back( nodeid );
+	fs.sizes.push_back( node_data_size( itr ) );
+      }
+      return fs;
+    }
+    fs.sizes.reserve( pit->top );
+    for ( auto oit = ofs.begin(); oit != ofs.end() && oit->id < pit->top; ++oit )
+      fs.sizes.push_back( oit->size );
+    for ( uint64_t nodeid = fs.sizes.size(); nodeid < pit->top; ++nodeid ) {
+      int32_t itr = find_node_row( store, nodeid );
+      fs.sizes.push_back( itr >= 0 ? node_data_size( itr ) : 0 );
+    }
+    return fs;
   }
 
   /*
@@ -144,95 +637,2111 @@ public:
   void setimmutable( name owner, name filename ) {
     files fls( _self, filename.value );
     files::const_iterator pit = auth_and_find_file( owner, filename, fls );
+    check_unstaged( *pit );
     check( pit->published, "File not published." );
     fls.modify( pit, same_payer, [&]( auto& p ) {
       p.owner = ""_n; // should be impossible to create an account with the empty name
     });
+    touch( owner, filename, ""_n );
+    log_change( owner, filename, CHANGE_SETIMMUTABLE );
+    notify_subscribers();
   }
 
   /*
-    Assign data to a node of an existing file.
-    A modified file is set to unpublished.
-    Cannot assign empty data using setnode (use delnode or reset instead).
-    Cannot assign non-empty data to any node above the top node.
+    Start a stage: a new generation of the file's data that all node changes go to, while
+      the file itself keeps serving the current generation unchanged (and published).
+    The stage is kept at scope filename | generation (generation 1 or 2) with a file row,
+      nodes and byte offset index of its own, and shares the file's current nodes until
+      they are written to (see clone), so it costs RAM for the changed nodes only.
+    commit makes the stage the file's current generation, and unstage drops it.
   */
   [[eosio::action]]
-  void setnode( name owner, name filename, uint64_t nodeid, vector<unsigned char> nodedata ) {
-    check( nodedata.size() > 0, "Empty nodedata." );
+  void stage( name owner, name filename ) {
+    files fls( _self, filename.value );
+    files::const_iterator pit = auth_and_find_file( owner, filename, fls );
+    check_unstaged( *pit );
+    check( pit->arrived.value_or( 0 ) == pit->reserved.value_or( 0 ), "Missing reserved nodes." );
+    uint8_t gen = pit->index_gen.value_or( 0 ) == 1 ? 2 : 1;
+    name store( filename.value | gen );
+    files sfls( _self, store.value );
+    check( sfls.begin() == sfls.end(), "Previous stage not yet cleared." );
+    sfls.emplace( owner, [&]( auto& p ) {
+      p.owner = owner;
+      p.top = pit->top;
+      p.published = false;
+      extend( p );
+      p.total_bytes.emplace( file_bytes( *pit ) );
+      p.uncounted.emplace( uncounted_node( *pit ) );
+      p.sparse.emplace( is_sparse( *pit ) );
+      if ( is_inline( *pit ) ) {
+	p.inline_data.emplace( pit->inline_data.value() );
+      } else {
+	p.base.emplace( filename );
+	p.shared.emplace( pit->top );
+      }
+    });
+    fls.modify( pit, same_payer, [&]( auto& p ) {
+      extend( p );
+      p.staged.emplace( gen );
+    });
+  }
 
+  /*
+    Make a file's stage its current generation, and publish it, in one action: only file
+      rows change, so readers switch from the old data to the new at once.
+    Same as setpub for the stage.
+    The stage's nodes are then merged into the file's own scope, up to CLEAR_NODES_LIMIT
+      rows of it in this action. Until gc has merged the rest, the contract reads the
+      file's nodes from the stage first (scope filename | overlay), the file cannot be
+      changed, and it is left unpublished, so that readers of the nodes table never see
+      the old nodes and the new top together. Once merged, the file is published, and
+      merkle starts its Merkle root if commit didn't.
+  */
+  [[eosio::action]]
+  void commit( name owner, name filename ) {
     files fls( _self, filename.value );
     files::const_iterator pit = auth_and_find_file( owner, filename, fls );
-    check( nodeid <= pit->top, "Past top." );
+    uint8_t gen = pit->staged.value_or( 0 );
+    check( gen != 0, "File not staged." );
+    name store( filename.value | gen );
+    files sfls( _self, store.value );
+    files::const_iterator sit = sfls.begin();
+    check( sit != sfls.end(), "Stage does not exist." );
+    check( sit->arrived.value_or( 0 ) == sit->reserved.value_or( 0 ), "Missing reserved nodes." );
+    log_change( owner, filename, CHANGE_COMMIT );
+    notify_subscribers();
     fls.modify( pit, same_payer, [&]( auto& p ) {
+      extend( p );
+      p.top = sit->top;
       p.published = false;
-      if ( p.top == nodeid )
-	++p.top;
+      p.total_bytes.emplace( sit->total_bytes.value() );
+      p.uncounted.emplace( sit->uncounted.value() );
+      p.root.emplace( checksum256() );
+      p.reserved.emplace( 0 );
+      p.arrived.emplace( 0 );
+      p.shared.emplace( std::min( p.shared.value(), sit->shared.value() ) );
+      p.inline_data.emplace( sit->inline_data.value() );
+      p.staged.emplace( 0 );
+      p.overlay.emplace( gen );
+      p.index_gen.emplace( gen );
+      p.sparse.emplace( is_sparse( *sit ) );
+      p.stale_offsets.emplace( sit->stale_offsets.value() );
     });
-    
-    nodes nds( _self, filename.value );
-    auto nit = nds.find( nodeid );
-    if (nit == nds.end()) {
-      nds.emplace( owner, [&]( auto& n ) {
-	n.id = nodeid;
-	n.data = nodedata;
-      });
+    drop_merkle( filename );
+    if ( merge_stage( fls, pit, filename, CLEAR_NODES_LIMIT ) )
+      merkle_step( fls, pit, owner, filename, merkle_state{}, MERKLE_NODES_LIMIT );
+  }
+
+  /*
+    Drop a file's stage. Its nodes are cleared like those of a deleted file: if there are
+      more than CLEAR_NODES_LIMIT, gc must be called with the stage's name (filename |
+      generation) until they are, before the file can be staged again.
+  */
+  [[eosio::action]]
+  void unstage( name owner, name filename ) {
+    files fls( _self, filename.value );
+    files::const_iterator pit = auth_and_find_file( owner, filename, fls );
+    uint8_t gen = pit->staged.value_or( 0 );
+    check( gen != 0, "File not staged." );
+    fls.modify( pit, same_payer, [&]( auto& p ) {
+      p.staged.emplace( 0 );
+    });
+    name store( filename.value | gen );
+    files sfls( _self, store.value );
+    check( sfls.begin() != sfls.end(), "Stage does not exist." );
+    if ( clear_nodes( store, CLEAR_NODES_LIMIT ) ) {
+      sfls.erase( sfls.begin() );
     } else {
-      nds.modify( nit, same_payer, [&]( auto& n ) {
-	n.data = nodedata;
+      sfls.modify( sfls.begin(), same_payer, [&]( auto& p ) {
+	p.status.emplace( FILE_DELETING );
       });
     }
   }
 
   /*
-    Pops off (erases) the top data node of file.
-   */
+    Let account upload to a file: set its nodes from first_node up to (not including)
+      end_node with setnode, setnodes, setblobnode, linknode, sethole and setrefnode, as
+      the owner can, paying for their RAM itself (also once a commit moves them from a stage
+      to the file). A large file (e.g. a reserved one) can then be split across many
+      uploaders, each with its own resource limits. Uploaders never make a file inline.
+    Adding an uploader again replaces its node range. owner pays for the RAM of the
+      uploader record. Resetting or deleting the file drops all of its uploaders.
+  */
   [[eosio::action]]
-  void delnode( name owner, name filename ) {
+  void adduploader( name owner, name filename, name account, uint64_t first_node, uint64_t end_node ) {
+    check( first_node < end_node, "Invalid node range." );
+    check( is_account( account ), "Uploader account does not exist." );
     files fls( _self, filename.value );
     files::const_iterator pit = auth_and_find_file( owner, filename, fls );
-    uint64_t top = pit->top;
-    check( top > 0, "Empty file." );
-    --top;
+    // Give the file row every extension field now, as the owner, so that writes by the
+    //   uploader never grow the owner's row.
+    fls.modify( pit, same_payer, [&]( auto& p ) {
+      extend( p );
+    });
+    uploaders ups( _self, filename.value );
+    auto uit = ups.find( account.value );
+    if ( uit == ups.end() ) {
+      ups.emplace( owner, [&]( auto& u ) {
+	u.account = account;
+	u.first = first_node;
+	u.end = end_node;
+      });
+    } else {
+      ups.modify( uit, same_payer, [&]( auto& u ) {
+	u.first = first_node;
+	u.end = end_node;
+      });
+    }
+  }
+
+  /*
+    Revoke an uploader of a file (see adduploader).
+  */
+  [[eosio::action]]
+  void rmuploader( name owner, name filename, name account ) {
+    files fls( _self, filename.value );
+    auth_and_find_file( owner, filename, fls );
+    uploaders ups( _self, filename.value );
+    ups.erase( ups.require_find( account.value, "Not an uploader." ) );
+  }
+
+  /*
+    Declare the number of nodes of an empty file up front.
+    Nodes of a reserved file can then be set in any order with setnode and setnodes, so
+      parts can be uploaded in parallel; arrivals are tracked in the file's bitmaps table.
+    A reserved file cannot be appended to or popped, and can only be published once
+      every node has arrived. Resetting the file drops the reservation.
+  */
+  [[eosio::action]]
+  void reserve( name owner, name filename, uint32_t nodecount ) {
+    check( nodecount > 0, "Invalid nodecount." );
+    name store = auth_and_find_store( owner, filename );
+    files fls( _self, store.value );
+    files::const_iterator pit = fls.begin();
+    check( pit->top == 0, "File not empty." );
+    check( ! is_sparse( *pit ), "File is sparse." );
     fls.modify( pit, same_payer, [&]( auto& p ) {
-      p.top = top;
+      extend( p );
+      p.reserved.emplace( nodecount );
       p.published = false;
     });
-    nodes nds( _self, filename.value );
-    auto nit = nds.find( top );
-    nds.erase( nit );
   }
 
-private:
+  /*
+    Lay out the nodes of an empty file sparsely: append and appendnodes leave SPARSE_GAP - 1
+      free node ids in front of each node they add, so that insertnode can later place a
+      node between any two nodes without renumbering the ones after it.
+    Readers of a sparse file follow node id order and skip the free ids: byte offsets,
+      the Merkle tree and stat count the nodes in that order.
+    A sparse file cannot be reserved or kept inline, and setnode and setnodes can only
+      overwrite its existing nodes. Resetting the file drops the sparse layout.
+  */
+  [[eosio::action]]
+  void setsparse( name owner, name filename ) {
+    name store = auth_and_find_store( owner, filename );
+    files fls( _self, store.value );
+    files::const_iterator pit = fls.begin();
+    check( pit->top == 0, "File not empty." );
+    check( pit->reserved.value_or( 0 ) == 0, "File is reserved." );
+    fls.modify( pit, same_payer, [&]( auto& p ) {
+      extend( p );
+      p.sparse.emplace( true );
+    });
+  }
 
-  // Expected name table from the system contract deployed at the system account.
-  // If your blockchain has different parameters for this, you must set it here.
-  static constexpr name SYSTEM_CONTRACT = "eosio"_n;
-  struct name_bid {
-    name            newname;
-    name            high_bidder;
-    int64_t         high_bid;
-    time_point      last_bid_time;
-    uint64_t primary_key()const { return newname.value;                    }
-    uint64_t by_high_bid()const { return static_cast<uint64_t>(-high_bid); }
-  };
-  typedef eosio::multi_index< "namebids"_n, name_bid,
-    indexed_by<"highbid"_n, const_mem_fun<name_bid, uint64_t, &name_bid::by_high_bid> >
-    > name_bid_table;
+  /*
+    Assign data to a node of an existing file, as its owner or one of its uploaders (see
+      adduploader).
+    A modified file is set to unpublished.
+    Cannot assign empty data using setnode (use delnode or reset instead).
+    Cannot assign non-empty data to any node above the top node, or for a reserved
+      file, to any node past the reserved node count, or for a sparse file, to any node
+      that it doesn't have (see insertnode).
+    A file whose only node is small enough is kept inline in its file row (see set_inline),
+      if the owner sets it, as the owner pays for the file row.
 
-  void clear_nodes( name filename ) {
-    nodes nds( _self, filename.value );
-    auto nit = nds.begin();
-    while ( nit != nds.end() ) {
-      nds.erase(nit++);
+    The arguments are decoded by hand from the action data (see node_row_reader) so that
+      nodedata is never copied into an intermediate vector: the serialized nodeid and
+      nodedata at the end of the action data are exactly a packed node row, which is
+      handed to the database as-is.
+  */
+  [[eosio::action]]
+  void setnode( eosio::ignore<name> owner, eosio::ignore<name> filename, eosio::ignore<uint64_t> nodeid, eosio::ignore<vector<unsigned char>> nodedata ) {
+    name _owner, _filename;
+    auto& ds = get_datastream();
+    ds >> _owner >> _filename;
+    node_row_reader row( ds );
+    check( ds.remaining() == 0, "Malformed nodedata." );
+
+    name store = auth_and_find_node_store( _owner, _filename, row.nodeid, row.nodeid + 1 );
+    files fls( _self, store.value );
+    files::const_iterator pit = fls.begin();
+    check_node_run( *pit, store, row.nodeid, row.nodeid + 1 );
+    log_change( _owner, store, CHANGE_SETNODE, row.nodeid );
+    if ( row.nodeid == 0 && _owner == pit->owner && fits_inline( *pit, row.datasize ) ) {
+      set_inline( fls, pit, store, row.data + row.size - row.datasize, row.datasize );
+      return;
     }
+    spill_inline( fls, pit, _owner, store );
+    uint64_t bytes = file_bytes( *pit );
+    optional<uint32_t> oldsize = set_node_row( _owner, store, row.nodeid, row.data, row.size );
+    checksum256 hash = sha256( row.data + row.size - row.datasize, row.datasize );
+    node_written( fls, pit, _owner, store, row.nodeid, row.datasize, hash, bytes, oldsize );
   }
 
-  files::const_iterator auth_and_find_file( name owner, name filename, const files & fls ) {
-    require_auth( owner );
+  /*
+    Assign data to a node of an existing file through the shared blob store.
+    If owner already has a blob with the same data, the node just references it; otherwise
+      the data is stored as a new blob, paid for by owner. Either way the node row itself
+      holds no data. Same rules as setnode otherwise.
+  */
+  [[eosio::action]]
+  void setblobnode( name owner, name filename, uint64_t nodeid, vector<unsigned char> nodedata ) {
+    check( nodedata.size() > 0, "Empty nodedata." );
+    name store = auth_and_find_node_store( owner, filename, nodeid, nodeid + 1 );
+    files fls( _self, store.value );
     files::const_iterator pit = fls.begin();
-    check( pit != fls.end(), "File does not exist." );
-    check( pit->owner == owner, "Not file owner." );
-    return pit;
+    check_node_run( *pit, store, nodeid, nodeid + 1 );
+    log_change( owner, store, CHANGE_SETNODE, nodeid );
+    spill_inline( fls, pit, owner, store );
+    uint64_t bytes = file_bytes( *pit );
+    checksum256 hash = sha256( reinterpret_cast<const char*>( nodedata.data() ), nodedata.size() );
+    uint32_t size;
+    uint64_t blobid = ref_blob( owner, hash, &nodedata, size );
+    optional<uint32_t> oldsize = set_blob_node( owner, store, nodeid, blobid );
+    node_written( fls, pit, owner, store, nodeid, size, hash, bytes, oldsize );
+  }
+
+  /*
+    Assign an existing shared blob of owner, given by the sha256 of its data, to a node of
+      an existing file. Sends only the hash, e.g. for re-uploading a part that hasn't changed
+      or that another file of owner already has. Same rules as setnode otherwise.
+  */
+  [[eosio::action]]
+  void linknode( name owner, name filename, uint64_t nodeid, checksum256 hash ) {
+    name store = auth_and_find_node_store( owner, filename, nodeid, nodeid + 1 );
+    files fls( _self, store.value );
+    files::const_iterator pit = fls.begin();
+    check_node_run( *pit, store, nodeid, nodeid + 1 );
+    log_change( owner, store, CHANGE_SETNODE, nodeid );
+    spill_inline( fls, pit, owner, store );
+    uint64_t bytes = file_bytes( *pit );
+    uint32_t size;
+    uint64_t blobid = ref_blob( owner, hash, nullptr, size );
+    optional<uint32_t> oldsize = set_blob_node( owner, store, nodeid, blobid );
+    node_written( fls, pit, owner, store, nodeid, size, hash, bytes, oldsize );
+  }
+
+  /*
+    Make a node of an existing file a hole: length bytes of zeros that readers expand,
+      kept as a node row of a few bytes instead of the zeros themselves. setnode (or
+      patchnode) turns a hole back into data. A hole is at most MAX_VIRTUAL_SIZE bytes
+      long, so long runs of zeros take a node per MAX_VIRTUAL_SIZE bytes.
+    Same rules as setnode otherwise.
+  */
+  [[eosio::action]]
+  void sethole( name owner, name filename, uint64_t nodeid, uint32_t length ) {
+    check( length > 0 && length <= MAX_VIRTUAL_SIZE, "Invalid length." );
+    name store = auth_and_find_node_store( owner, filename, nodeid, nodeid + 1 );
+    files fls( _self, store.value );
+    files::const_iterator pit = fls.begin();
+    check_node_run( *pit, store, nodeid, nodeid + 1 );
+    log_change( owner, store, CHANGE_SETNODE, nodeid );
+    spill_inline( fls, pit, owner, store );
+    uint64_t bytes = file_bytes( *pit );
+    node n{ nodeid };
+    n.blob.emplace( 0 );
+    n.hole.emplace( length );
+    vector<char> row = pack( n );
+    optional<uint32_t> oldsize = set_node_row( owner, store, nodeid, row.data(), row.size() );
+    node_written( fls, pit, owner, store, nodeid, length, hole_hash( length ), bytes, oldsize );
+  }
+
+  /*
+    Make a node of an existing file a reference to length bytes of file source, starting
+      at byte offset: readers read those bytes from source, and the node row takes a few
+      bytes instead of a copy of them. A file made of reference nodes is a composite file,
+      e.g. a bundle of other files or of parts of them.
+    source must be immutable, so that the referenced bytes never change. setnode (or
+      patchnode) turns a reference node back into data. A reference node holds at most
+      MAX_VIRTUAL_SIZE bytes.
+    Same rules as setnode otherwise.
+  */
+  [[eosio::action]]
+  void setrefnode( name owner, name filename, uint64_t nodeid, name source, uint64_t offset, uint32_t length ) {
+    check( length > 0 && length <= MAX_VIRTUAL_SIZE, "Invalid length." );
+    check_source( source );
+    vector<char> data;
+    vector<char> row = ref_node_row( nodeid, source, offset, length, data );
+
+    name store = auth_and_find_node_store( owner, filename, nodeid, nodeid + 1 );
+    files fls( _self, store.value );
+    files::const_iterator pit = fls.begin();
+    check_node_run( *pit, store, nodeid, nodeid + 1 );
+    log_change( owner, store, CHANGE_SETNODE, nodeid );
+    spill_inline( fls, pit, owner, store );
+    uint64_t bytes = file_bytes( *pit );
+    optional<uint32_t> oldsize = set_node_row( owner, store, nodeid, row.data(), row.size() );
+    node_written( fls, pit, owner, store, nodeid, length, sha256( data.data(), data.size() ), bytes, oldsize );
+  }
+
+  /*
+    Assign data to a run of consecutive nodes of an existing file, starting at first_nodeid.
+    Same rules as setnode, but the file is authorized, found and updated only once for
+      the whole run, which saves the fixed per-action overhead when uploading many parts.
+    Each nodedata is copied exactly once, from the action data into its packed node row.
+  */
+  [[eosio::action]]
+  void setnodes( eosio::ignore<name> owner, eosio::ignore<name> filename, eosio::ignore<uint64_t> first_nodeid, eosio::ignore<vector<vector<unsigned char>>> nodedatas ) {
+    name _owner, _filename;
+    uint64_t _first_nodeid;
+    unsigned_int count;
+    auto& ds = get_datastream();
+    ds >> _owner >> _filename >> _first_nodeid >> count;
+    check( count.value > 0, "Empty nodedatas." );
+
+    name store = auth_and_find_node_store( _owner, _filename, _first_nodeid, _first_nodeid + count.value );
+    files fls( _self, store.value );
+    files::const_iterator pit = fls.begin();
+    uint64_t end = _first_nodeid + count.value;
+    check_node_run( *pit, store, _first_nodeid, end );
+    spill_inline( fls, pit, _owner, store );
+    bool reserved = pit->reserved.value_or( 0 ) > 0;
+    uint64_t bytes = file_bytes( *pit );
+
+    log_change( _owner, store, CHANGE_SETNODE, _first_nodeid, count.value );
+    bitmaps bms( _self, store.value );
+    uint32_t added = 0;
+    vector<char> row;
+    for ( uint64_t nodeid = _first_nodeid; nodeid < end; ++nodeid ) {
+      uint32_t datasize = read_node_row( ds, nodeid, row );
+      bytes += counted( *pit, nodeid, datasize );
+      optional<uint32_t> oldsize = set_node_row( _owner, store, nodeid, row.data(), row.size() );
+      index_node( fls, pit, _owner, store, nodeid, datasize, sha256( row.data() + row.size() - datasize, datasize ) );
+      if ( oldsize ) {
+	bytes -= counted( *pit, nodeid, *oldsize );
+      } else if ( reserved ) {
+	set_arrived( bms, _owner, nodeid );
+	++added;
+      }
+    }
+    check( ds.remaining() == 0, "Malformed nodedata." );
+
+    fls.modify( pit, same_payer, [&]( auto& p ) {
+      p.published = false;
+      if ( p.top < end )
+	p.top = end;
+      extend( p );
+      p.total_bytes.emplace( bytes );
+      if ( added > 0 )
+	p.arrived.value() += added;
+    });
+  }
+
+  /*
+    Append a data node to the end of an existing file (at its top node, or for a sparse
+      file, at the next multiple of SPARSE_GAP above it, see append_node_id).
+    Same as setnode with nodeid == top, but the caller doesn't need to know the top, and
+      since there is never a node at or above top, the node is stored without any lookup.
+  */
+  [[eosio::action]]
+  void append( eosio::ignore<name> owner, eosio::ignore<name> filename, eosio::ignore<vector<unsigned char>> nodedata ) {
+    name _owner, _filename;
+    auto& ds = get_datastream();
+    ds >> _owner >> _filename;
+
+    name store = auth_and_find_store( _owner, _filename );
+    files fls( _self, store.value );
+    files::const_iterator pit = fls.begin();
+    check( pit->reserved.value_or( 0 ) == 0, "File is reserved." );
+    uint64_t nodeid = append_node_id( *pit, 1 );
+    uint64_t bytes = file_bytes( *pit );
+
+    vector<char> row;
+    uint32_t datasize = read_node_row( ds, nodeid, row );
+    bytes += counted( *pit, nodeid, datasize );
+    check( ds.remaining() == 0, "Malformed nodedata." );
+    log_change( _owner, store, CHANGE_SETNODE, nodeid );
+    if ( nodeid == 0 && fits_inline( *pit, datasize ) ) {
+      set_inline( fls, pit, store, row.data() + row.size() - datasize, datasize );
+      return;
+    }
+    spill_inline( fls, pit, _owner, store );
+    store_node_row( _owner, store, nodeid, row.data(), row.size() );
+    index_node( fls, pit, _owner, store, nodeid, datasize, sha256( row.data() + row.size() - datasize, datasize ) );
+
+    fls.modify( pit, same_payer, [&]( auto& p ) {
+      p.published = false;
+      p.top = nodeid + 1;
+      extend( p );
+      p.total_bytes.emplace( bytes );
+    });
+  }
+
+  /*
+    Append several data nodes to the end of an existing file, in order.
+  */
+  [[eosio::action]]
+  void appendnodes( eosio::ignore<name> owner, eosio::ignore<name> filename, eosio::ignore<vector<vector<unsigned char>>> nodedatas ) {
+    name _owner, _filename;
+    unsigned_int count;
+    auto& ds = get_datastream();
+    ds >> _owner >> _filename >> count;
+    check( count.value > 0, "Empty nodedatas." );
+
+    name store = auth_and_find_store( _owner, _filename );
+    files fls( _self, store.value );
+    files::const_iterator pit = fls.begin();
+    check( pit->reserved.value_or( 0 ) == 0, "File is reserved." );
+    spill_inline( fls, pit, _owner, store );
+    uint64_t step = is_sparse( *pit ) ? SPARSE_GAP : 1;
+    uint64_t first_nodeid = append_node_id( *pit, count.value );
+    uint64_t end = first_nodeid + step * ( count.value - 1 ) + 1;
+    uint64_t bytes = file_bytes( *pit );
+
+    log_change( _owner, store, CHANGE_SETNODE, first_nodeid, count.value );
+    vector<char> row;
+    for ( uint64_t nodeid = first_nodeid; nodeid < end; nodeid += step ) {
+      uint32_t datasize = read_node_row( ds, nodeid, row );
+      bytes += counted( *pit, nodeid, datasize );
+      store_node_row( _owner, store, nodeid, row.data(), row.size() );
+      index_node( fls, pit, _owner, store, nodeid, datasize, sha256( row.data() + row.size() - datasize, datasize ) );
+    }
+    check( ds.remaining() == 0, "Malformed nodedata." );
+
+    fls.modify( pit, same_payer, [&]( auto& p ) {
+      p.published = false;
+      p.top = end;
+      extend( p );
+      p.total_bytes.emplace( bytes );
+    });
+  }
+
+  /*
+    Append a new version of file source to the end of an existing file, given as a delta
+      against source: a list of operations that either copy a byte range of source, or
+      insert new bytes. Each copy becomes reference nodes (see setrefnode), split every
+      MAX_VIRTUAL_SIZE bytes, and each insert a data node, so a version that differs from
+      source by small edits costs RAM for the edits only. Readers such as readrange see
+      the materialized version.
+    source must be immutable. Same as appendnodes otherwise.
+  */
+  [[eosio::action]]
+  void appenddelta( name owner, name filename, name source, vector<delta_op> ops ) {
+    check( ops.size() > 0, "Empty ops." );
+    check_source( source );
+    uint32_t count = 0;
+    for ( const delta_op & op : ops ) {
+      check( op.data.empty() ? op.length > 0 : op.length == 0, "Invalid op." );
+      count += op.data.empty() ? ( op.length - 1 ) / MAX_VIRTUAL_SIZE + 1 : 1;
+    }
+
+    name store = auth_and_find_store( owner, filename );
+    files fls( _self, store.value );
+    files::const_iterator pit = fls.begin();
+    check( pit->reserved.value_or( 0 ) == 0, "File is reserved." );
+    spill_inline( fls, pit, owner, store );
+    uint64_t step = is_sparse( *pit ) ? SPARSE_GAP : 1;
+    uint64_t nodeid = append_node_id( *pit, count );
+    uint64_t bytes = file_bytes( *pit );
+
+    log_change( owner, store, CHANGE_SETNODE, nodeid, count );
+    vector<char> data;
+    for ( const delta_op & op : ops ) {
+      for ( uint64_t done = 0; done < op.length || done < op.data.size(); nodeid += step ) {
+	vector<char> row;
+	if ( op.data.empty() ) {
+	  uint32_t length = std::min<uint64_t>( op.length - done, MAX_VIRTUAL_SIZE );
+	  row = ref_node_row( nodeid, source, op.offset + done, length, data );
+	} else {
+	  row = pack( node{ nodeid, op.data } );
+	  data.assign( op.data.begin(), op.data.end() );
+	}
+	done += data.size();
+	bytes += counted( *pit, nodeid, data.size() );
+	store_node_row( owner, store, nodeid, row.data(), row.size() );
+	index_node( fls, pit, owner, store, nodeid, data.size(), sha256( data.data(), data.size() ) );
+      }
+    }
+
+    fls.modify( pit, same_payer, [&]( auto& p ) {
+      p.published = false;
+      p.top = nodeid - step + 1;
+      extend( p );
+      p.total_bytes.emplace( bytes );
+    });
+  }
+
+  /*
+    Insert a data node into a sparse file (see setsparse) as node nodeid, which must be a
+      free node id below the file's top: the node is read between the nodes whose ids are
+      around nodeid, and no other node row changes. A client picks nodeid in the middle
+      of the free ids between the two nodes, to leave room for further inserts.
+    The byte offsets of the nodes after it are left for reindex to move (see index_node).
+    Same rules as setnode otherwise.
+  */
+  [[eosio::action]]
+  void insertnode( eosio::ignore<name> owner, eosio::ignore<name> filename, eosio::ignore<uint64_t> nodeid, eosio::ignore<vector<unsigned char>> nodedata ) {
+    name _owner, _filename;
+    auto& ds = get_datastream();
+    ds >> _owner >> _filename;
+    node_row_reader row( ds );
+    check( ds.remaining() == 0, "Malformed nodedata." );
+
+    name store = auth_and_find_store( _owner, _filename );
+    files fls( _self, store.value );
+    files::const_iterator pit = fls.begin();
+    check( is_sparse( *pit ), "File not sparse." );
+    check( row.nodeid < pit->top, "Past top." );
+    check( find_node_row( store, row.nodeid ) < 0, "Node exists." );
+    log_change( _owner, store, CHANGE_INSERTNODE, row.nodeid );
+    uint64_t bytes = file_bytes( *pit );
+    store_node_row( _owner, store, row.nodeid, row.data, row.size );
+    checksum256 hash = sha256( row.data + row.size - row.datasize, row.datasize );
+    node_written( fls, pit, _owner, store, row.nodeid, row.datasize, hash, bytes, optional<uint32_t>() );
+  }
+
+  /*
+    Overwrite bytes of an existing node, starting at offset, with patchdata.
+    The node grows if the patch runs past its end; offset cannot be past the end of the node.
+    Lets small edits be sent without re-sending the whole node.
+    Patching a node that references a shared blob, or that a clone shares with its base,
+      gives it its own copy of the data.
+    A modified file is set to unpublished.
+  */
+  [[eosio::action]]
+  void patchnode( name owner, name filename, uint64_t nodeid, uint32_t offset, vector<unsigned char> patchdata ) {
+    check( patchdata.size() > 0, "Empty patchdata." );
+
+    name store = auth_and_find_store( owner, filename );
+    files fls( _self, store.value );
+    files::const_iterator pit = fls.begin();
+    check( nodeid < pit->top, "Past top." );
+    log_change( owner, store, CHANGE_SETNODE, nodeid );
+    spill_inline( fls, pit, owner, store );
+    uint64_t bytes = file_bytes( *pit );
+
+    int32_t itr = internal_use_do_not_use::db_find_i64( _self.value, store.value, "nodes"_n.value, nodeid );
+    uint64_t blobid;
+    vector<char> row = get_node_row( itr >= 0 ? itr : find_base_node( store, nodeid ), blobid );
+    datastream<const char*> rs( row.data(), row.size() );
+    unsigned_int size;
+    rs >> nodeid >> size;
+    check( offset <= size.value, "Past end of node." );
+    uint32_t datapos = rs.tellp();
+    uint64_t end = uint64_t(offset) + patchdata.size();
+    if ( end > size.value ) {
+      // Node grows, and so may the length prefix in front of its data.
+      vector<char> grown( pack_size( nodeid ) + pack_size( unsigned_int(end) ) + end );
+      datastream<char*> ws( grown.data(), grown.size() );
+      ws << nodeid << unsigned_int(end);
+      ws.write( row.data() + datapos, size.value );
+      datapos = pack_size( nodeid ) + pack_size( unsigned_int(end) );
+      row.swap( grown );
+      bytes += counted( *pit, nodeid, end - size.value );
+    }
+    memcpy( row.data() + datapos + offset, patchdata.data(), patchdata.size() );
+    if ( itr >= 0 ) {
+      internal_use_do_not_use::db_update_i64( itr, owner.value, row.data(), row.size() );
+      note_payer( owner, store, nodeid );
+      if ( blobid != 0 )
+	unref_blob( blobid );
+    } else {
+      store_node_row( owner, store, nodeid, row.data(), row.size() );
+    }
+    index_node( fls, pit, owner, store, nodeid, row.size() - datapos, sha256( row.data() + datapos, row.size() - datapos ) );
+
+    fls.modify( pit, same_payer, [&]( auto& p ) {
+      p.published = false;
+      extend( p );
+      p.total_bytes.emplace( bytes );
+    });
+  }
+
+  /*
+    Bring the byte offset index of a file up to date, a step of up to max_rows records at a
+      time: first count the nodes of a file that predates file::total_bytes into it (see
+      count_bytes), then fix the offsets that node size changes left stale (see
+      index_node), then extend the index to the nodes that writes didn't index, such as
+      those of files written before the index existed, out of order nodes of reserved
+      files, and the nodes of clones and stages.
+    Anyone can call it, and payer pays for the RAM of the index records. The index of a
+      file's pending stage is updated, if it has one.
+  */
+  [[eosio::action]]
+  void reindex( name payer, name filename, uint32_t max_rows ) {
+    require_auth( payer );
+    check( max_rows > 0, "Invalid max_rows." );
+    name store = index_store( filename );
+    count_bytes( filename, max_rows );
+    if ( max_rows == 0 )
+      return;
+    files fls( _self, store.value );
+    files::const_iterator pit = fls.begin();
+    fix_offsets( fls, pit, store, max_rows );
+    if ( max_rows == 0 )
+      return;
+    offsets ofs( _self, index_scope( *pit, store ) );
+    index_nodes( ofs, payer, store, is_sparse( *pit ), max_rows );
+  }
+
+  /*
+    Pops off (erases) the top data node of file.
+    A file left with a single node small enough to be inline is made inline (see set_inline).
+   */
+  [[eosio::action]]
+  void delnode( name owner, name filename ) {
+    name store = auth_and_find_store( owner, filename );
+    files fls( _self, store.value );
+    files::const_iterator pit = fls.begin();
+    check( pit->reserved.value_or( 0 ) == 0, "File is reserved." );
+    check( pit->top > 0, "Empty file." );
+    uint64_t top = pop_nodes( fls, pit, store, 0, 1 );
+    log_change( owner, store, CHANGE_DELNODE, top );
+  }
+
+  /*
+    Pops off (erases) the top data nodes of a file down to new_top, with a single file
+      update, like that many delnode calls.
+    At most TRUNCATE_NODES_LIMIT nodes are erased per call, top ones first; if there are
+      more, call again with the same new_top until the file's top reaches it.
+   */
+  [[eosio::action]]
+  void truncate( name owner, name filename, uint32_t new_top ) {
+    name store = auth_and_find_store( owner, filename );
+    files fls( _self, store.value );
+    files::const_iterator pit = fls.begin();
+    check( pit->reserved.value_or( 0 ) == 0, "File is reserved." );
+    check( new_top < pit->top, "Past top." );
+    uint64_t top = pop_nodes( fls, pit, store, new_top, TRUNCATE_NODES_LIMIT );
+    log_change( owner, store, CHANGE_TRUNCATE, top );
+  }
+
+private:
+
+  // Expected name table from the system contract deployed at the system account.
+  // If your blockchain has different parameters for this, you must set it here.
+  static constexpr name SYSTEM_CONTRACT = "eosio"_n;
+  struct name_bid {
+    name            newname;
+    name            high_bidder;
+    int64_t         high_bid;
+    time_point      last_bid_time;
+    uint64_t primary_key()const { return newname.value;                    }
+    uint64_t by_high_bid()const { return static_cast<uint64_t>(-high_bid); }
+  };
+  typedef eosio::multi_index< "namebids"_n, name_bid,
+    indexed_by<"highbid"_n, const_mem_fun<name_bid, uint64_t, &name_bid::by_high_bid> >
+    > name_bid_table;
+
+  // Reads a serialized (nodeid, nodedata) pair in place. Since that is also the layout
+  //   of a packed node row, data/size then point at a ready-made row inside the stream.
+  struct node_row_reader {
+    const char *            data;
+    uint32_t                size;
+    uint64_t                nodeid;
+    uint32_t                datasize;
+    node_row_reader( datastream<const char*> & ds ) : data( ds.pos() ) {
+      unsigned_int len;
+      ds >> nodeid >> len;
+      datasize = len.value;
+      check( datasize > 0, "Empty nodedata." );
+      check( datasize <= ds.remaining(), "Malformed nodedata." );
+      ds.skip( datasize );
+      size = ds.pos() - data;
+    }
+  };
+
+  // Reads one serialized nodedata from the action data and packs it, with nodeid, into
+  //   row. This is the only copy made of the node data. Returns the node data size.
+  uint32_t read_node_row( datastream<const char*> & ds, uint64_t nodeid, vector<char> & row ) {
+    unsigned_int size;
+    ds >> size;
+    check( size.value > 0, "Empty nodedata." );
+    check( size.value <= ds.remaining(), "Malformed nodedata." );
+    row.resize( pack_size( nodeid ) + pack_size( size ) + size.value );
+    datastream<char*> rs( row.data(), row.size() );
+    rs << nodeid << size;
+    rs.write( ds.pos(), size.value );
+    ds.skip( size.value );
+    return size.value;
+  }
+
+  // Writes a packed node row straight through the database intrinsics. Going through
+  //   nodes::find and nodes::modify would load and unpack the old row (up to a whole node
+  //   of data) only to throw it away; here the new row is stored without reading the old one.
+  // Returns the data size of the node that was overwritten, if the node existed before.
+  // The overwritten node's reference to a shared blob, if any, is released. A node that a
+  //   clone shares with its base is not overwritten, but shadowed by a row of its own.
+  // owner pays for the row either way: an overwritten row that another account (e.g. an
+  //   uploader) paid for moves to owner's RAM, so owner never grows someone else's row.
+  optional<uint32_t> set_node_row( name owner, name filename, uint64_t nodeid, const char * row, uint32_t size ) {
+    int32_t itr = internal_use_do_not_use::db_find_i64( _self.value, filename.value, "nodes"_n.value, nodeid );
+    if ( itr >= 0 ) {
+      uint64_t blobid;
+      uint32_t oldsize = node_data_size( itr, &blobid );
+      internal_use_do_not_use::db_update_i64( itr, owner.value, row, size );
+      note_payer( owner, filename, nodeid );
+      if ( blobid != 0 )
+	unref_blob( blobid );
+      return oldsize;
+    }
+    optional<uint32_t> oldsize;
+    itr = find_base_node( filename, nodeid );
+    if ( itr >= 0 )
+      oldsize = node_data_size( itr );
+    store_node_row( owner, filename, nodeid, row, size );
+    return oldsize;
+  }
+
+  // Finds the row of a node of a file, which may be a row of a base file (see clone).
+  // Returns a negative iterator if the file has no such node.
+  int32_t find_node_row( name filename, uint64_t nodeid ) {
+    int32_t itr = internal_use_do_not_use::db_find_i64( _self.value, filename.value, "nodes"_n.value, nodeid );
+    return itr >= 0 ? itr : find_base_node( filename, nodeid );
+  }
+
+  // Finds the row of a node that a file doesn't have a row for, but shares with its base
+  //   file, following the chain of bases. Returns a negative iterator if there is none.
+  int32_t find_base_node( name filename, uint64_t nodeid ) {
+    files fls( _self, filename.value );
+    files::const_iterator pit = fls.begin();
+    if ( pit == fls.end() || nodeid >= pit->shared.value_or( 0 ) )
+      return -1;
+    return find_node_row( pit->base.value(), nodeid );
+  }
+
+  // Reads up to length bytes of a file's data, starting at byte offset (see readrange).
+  vector<char> read_range( name filename, uint64_t offset, uint32_t length ) {
+    files fls( _self, filename.value );
+    files::const_iterator pit = fls.begin();
+    check( pit != fls.end(), "File does not exist." );
+    // A file whose size is still being counted (see count_bytes) is read up to its last node.
+    bool sized = uncounted_node( *pit ) == BYTES_COUNTED;
+    uint64_t bytes = file_bytes( *pit );
+    vector<char> data;
+    if ( sized && offset >= bytes )
+      return data;
+    uint64_t count = sized ? std::min<uint64_t>( length, bytes - offset ) : length;
+    if ( is_inline( *pit ) ) {
+      auto first = pit->inline_data.value().begin() + offset;
+      data.assign( first, first + count );
+      return data;
+    }
+    // Reserve no more than a virtual node's worth up front, whatever length asks for
+    //   (e.g. UINT32_MAX for the rest of the file).
+    data.reserve( std::min<uint64_t>( count, MAX_VIRTUAL_SIZE ) );
+
+    name store = live_store( *pit, filename );
+    bool sparse = is_sparse( *pit );
+    uint64_t start;
+    uint64_t nodeid = find_node( store, offset, start, sparse );
+    for ( ; data.size() < length; ++nodeid ) {
+      int32_t itr = find_next_node_row( store, nodeid, sparse );
+      if ( itr < 0 )
+	break;
+      uint64_t blobid;
+      bool virt;
+      uint32_t size = node_data_size( itr, &blobid, &virt );
+      uint64_t skip = offset + data.size() - start;
+      uint64_t count = std::min<uint64_t>( size - skip, length - data.size() );
+      if ( virt ) {
+	// Only the part of a virtual node that is read is made: its zeros, or the bytes it
+	//   references, not the whole node (up to MAX_VIRTUAL_SIZE) as get_node_row does.
+	node n = unpack<node>( get_row( itr ) );
+	if ( n.source.has_value() ) {
+	  vector<char> part = read_range( n.source.value(), n.source_offset.value() + skip, count );
+	  check( part.size() == count, "Source range unavailable." );
+	  data.insert( data.end(), part.begin(), part.end() );
+	} else {
+	  data.resize( data.size() + count );
+	}
+      } else {
+	// The data is at the end of the node's row, or of its blob's data row.
+	vector<char> row = get_row( blobid == 0 ? itr : internal_use_do_not_use::db_find_i64( _self.value, _self.value, "blobdata"_n.value, blobid ) );
+	const char * first = row.data() + row.size() - size + skip;
+	data.insert( data.end(), first, first + count );
+      }
+      start += size;
+    }
+    return data;
+  }
+
+  // Checks that a file can be the source of reference nodes (see setrefnode).
+  void check_source( name source ) {
+    files srcs( _self, source.value );
+    files::const_iterator sit = srcs.begin();
+    check( sit != srcs.end(), "Source file does not exist." );
+    check( sit->owner == name(), "Source file not immutable." );
+  }
+
+  // Packed row of a reference node (see setrefnode) to length bytes of source at offset.
+  // The referenced bytes are read into data, for the node's hash.
+  vector<char> ref_node_row( uint64_t nodeid, name source, uint64_t offset, uint32_t length, vector<char> & data ) {
+    data = read_range( source, offset, length );
+    check( data.size() == length, "Past end of source." );
+    node n{ nodeid };
+    n.blob.emplace( 0 );
+    n.hole.emplace( length );
+    n.source.emplace( source );
+    n.source_offset.emplace( offset );
+    return pack( n );
+  }
+
+  // Finds the row of the first node of a file at or after nodeid: that of nodeid itself,
+  //   or for a sparse file, of the next node past any free node ids, whose id is then
+  //   stored in nodeid. Returns a negative iterator if there is none.
+  int32_t find_next_node_row( name filename, uint64_t & nodeid, bool sparse ) {
+    int32_t itr = find_node_row( filename, nodeid );
+    if ( itr >= 0 || ! sparse )
+      return itr;
+    nodeid = next_node_id( filename, nodeid );
+    return find_node_row( filename, nodeid );
+  }
+
+  // Id of the first node of a sparse file (see setsparse) at or after nodeid, whether the
+  //   file has a row for it or shares it with its base; the file's top if there is none.
+  // Node rows start with the node id, so only that much of the row is read.
+  uint64_t next_node_id( name filename, uint64_t nodeid ) {
+    files fls( _self, filename.value );
+    files::const_iterator pit = fls.begin();
+    uint64_t next = pit->top;
+    int32_t itr = internal_use_do_not_use::db_lowerbound_i64( _self.value, filename.value, "nodes"_n.value, nodeid );
+    if ( itr >= 0 )
+      internal_use_do_not_use::db_get_i64( itr, reinterpret_cast<char*>( &next ), sizeof(next) );
+    uint64_t shared = pit->shared.value_or( 0 );
+    if ( nodeid < shared ) {
+      uint64_t baseid = next_node_id( pit->base.value(), nodeid );
+      if ( baseid < std::min( next, shared ) )
+	next = baseid;
+    }
+    return next;
+  }
+
+  // Id of the last node of a sparse file (see setsparse) below nodeid, whether the file has
+  //   a row for it or shares it with its base. Returns false if there is none.
+  bool last_node_id( name filename, uint64_t nodeid, uint64_t & lastid ) {
+    bool found = false;
+    int32_t itr = internal_use_do_not_use::db_lowerbound_i64( _self.value, filename.value, "nodes"_n.value, nodeid );
+    uint64_t id;
+    // -1 means the scope has no node rows at all; an end iterator steps back to the last row.
+    if ( itr != -1 && internal_use_do_not_use::db_previous_i64( itr, &id ) >= 0 ) {
+      lastid = id;
+      found = true;
+    }
+    files fls( _self, filename.value );
+    files::const_iterator pit = fls.begin();
+    uint64_t shared = pit->shared.value_or( 0 );
+    if ( shared > 0 && last_node_id( pit->base.value(), std::min( nodeid, shared ), id ) && ( ! found || id > lastid ) ) {
+      lastid = id;
+      found = true;
+    }
+    return found;
+  }
+
+  // Sets a node to reference a shared blob (see set_node_row).
+  optional<uint32_t> set_blob_node( name owner, name filename, uint64_t nodeid, uint64_t blobid ) {
+    node n{ nodeid };
+    n.blob.emplace( blobid );
+    vector<char> row = pack( n );
+    return set_node_row( owner, filename, nodeid, row.data(), row.size() );
+  }
+
+  // Data size of a node, read from the length prefix of its row without loading the data.
+  // Also gives the id of the shared blob that holds the node's data (0 == none), and
+  //   whether the node is virtual (see node).
+  uint32_t node_data_size( int32_t itr, uint64_t * blobid = nullptr, bool * virt = nullptr ) {
+    check( itr >= 0, "Node does not exist." );
+    char header[21]; // node id and up to 5 bytes of data length, or a zero length, a blob id and a virtual size
+    uint32_t size = internal_use_do_not_use::db_get_i64( itr, header, sizeof(header) );
+    datastream<const char*> ds( header, size );
+    uint64_t nodeid;
+    unsigned_int datasize;
+    uint64_t id = 0;
+    uint32_t holesize = 0;
+    ds >> nodeid >> datasize;
+    if ( datasize.value == 0 && ds.remaining() >= sizeof(id) ) {
+      ds >> id;
+      if ( id == 0 && ds.remaining() >= sizeof(holesize) )
+	ds >> holesize;
+    }
+    if ( blobid != nullptr )
+      *blobid = id;
+    if ( virt != nullptr )
+      *virt = holesize > 0;
+    if ( id == 0 )
+      return datasize.value + holesize;
+    blobs bls( _self, _self.value );
+    return bls.get( id, "Blob does not exist." ).size;
+  }
+
+  // Reads a whole node row, as a packed node row that holds the node's data: the row of
+  //   a node that references a shared blob is made from the blob's data row, which has
+  //   the same layout, and that of a virtual node is filled with its zeros, or with the
+  //   bytes it references. Also gives the id of the blob (0 == none).
+  vector<char> get_node_row( int32_t itr, uint64_t & blobid ) {
+    bool virt;
+    uint32_t size = node_data_size( itr, &blobid, &virt );
+    if ( blobid == 0 && ! virt )
+      return get_row( itr );
+    uint64_t nodeid;
+    internal_use_do_not_use::db_get_i64( itr, reinterpret_cast<char*>( &nodeid ), sizeof(nodeid) );
+    if ( virt ) {
+      vector<char> row( pack_size( nodeid ) + pack_size( unsigned_int(size) ) + size );
+      datastream<char*> ws( row.data(), row.size() );
+      ws << nodeid << unsigned_int(size);
+      vector<char> packed = get_row( itr );
+      node n = unpack<node>( packed );
+      if ( n.source.has_value() ) {
+	vector<char> data = read_range( n.source.value(), n.source_offset.value(), size );
+	check( data.size() == size, "Source range unavailable." );
+	ws.write( data.data(), size );
+      }
+      return row;
+    }
+    vector<char> row = get_row( internal_use_do_not_use::db_find_i64( _self.value, _self.value, "blobdata"_n.value, blobid ) );
+    memcpy( row.data(), &nodeid, sizeof(nodeid) );
+    return row;
+  }
+
+  // Adds a node reference to payer's shared blob with the given hash and returns its id
+  //   and data size. If payer has no such blob, it is created from data.
+  uint64_t ref_blob( name payer, const checksum256 & hash, const vector<unsigned char> * data, uint32_t & size ) {
+    blobs bls( _self, _self.value );
+    auto idx = bls.get_index<"bykey"_n>();
+    auto bit = idx.find( blob::key( payer, hash ) );
+    if ( bit != idx.end() ) {
+      uint64_t blobid = bit->id;
+      size = bit->size;
+      idx.modify( bit, same_payer, [&]( auto& b ) {
+	++b.refs;
+      });
+      return blobid;
+    }
+    check( data != nullptr, "Blob does not exist." );
+    uint64_t blobid = std::max<uint64_t>( 1, bls.available_primary_key() );
+    size = data->size();
+    bls.emplace( payer, [&]( auto& b ) {
+      b.id = blobid;
+      b.payer = payer;
+      b.hash = hash;
+      b.size = size;
+      b.refs = 1;
+    });
+    blob_data_table bds( _self, _self.value );
+    bds.emplace( payer, [&]( auto& b ) {
+      b.id = blobid;
+      b.data = *data;
+    });
+    return blobid;
+  }
+
+  // Drops a node reference to a shared blob, and erases the blob if it was the last one.
+  // The blob data row is removed without loading it.
+  void unref_blob( uint64_t blobid ) {
+    blobs bls( _self, _self.value );
+    auto bit = bls.require_find( blobid, "Blob does not exist." );
+    if ( bit->refs > 1 ) {
+      bls.modify( bit, same_payer, [&]( auto& b ) {
+	--b.refs;
+      });
+      return;
+    }
+    bls.erase( bit );
+    int32_t itr = internal_use_do_not_use::db_find_i64( _self.value, _self.value, "blobdata"_n.value, blobid );
+    if ( itr >= 0 )
+      internal_use_do_not_use::db_remove_i64( itr );
+  }
+
+  // Finishes setting a single node of a file after its row was written with set_node_row,
+  //   given the node's data size and hash and the file's total data size before the write:
+  //   updates the byte offset index, the file row and the reserved node arrivals.
+  void node_written( files & fls, files::const_iterator pit, name owner, name filename, uint64_t nodeid,
+		     uint32_t size, const checksum256 & hash, uint64_t bytes, optional<uint32_t> oldsize ) {
+    bool added = ! oldsize;
+    bool reserved = pit->reserved.value_or( 0 ) > 0;
+    bytes += counted( *pit, nodeid, size );
+    bytes -= counted( *pit, nodeid, oldsize.value_or( 0 ) );
+    index_node( fls, pit, owner, filename, nodeid, size, hash );
+    fls.modify( pit, same_payer, [&]( auto& p ) {
+      p.published = false;
+      if ( p.top <= nodeid )
+	p.top = nodeid + 1;
+      extend( p );
+      p.total_bytes.emplace( bytes );
+      if ( added && reserved )
+	++p.arrived.value();
+    });
+    if ( added && reserved ) {
+      bitmaps bms( _self, filename.value );
+      set_arrived( bms, owner, nodeid );
+    }
+  }
+
+  // Updates the byte offset index after node nodeid was set to size bytes of data with
+  //   the given hash: the record of an indexed node is updated, and one is added for a
+  //   node that directly follows the last indexed node, followed by records for up to
+  //   INDEX_WRITE_LIMIT nodes after it that were written before it (e.g. out of order
+  //   nodes of a reserved file), if there can be any below the file's top. Any other node
+  //   is left for reindex to index.
+  // An indexed node that changed size moves the offsets of the indexed nodes after it, and
+  //   so does a node inserted in front of an indexed node (see insertnode), which is
+  //   indexed right after the node before it. Up to INDEX_WRITE_LIMIT records are moved
+  //   right away, and any others are left stale (see mark_stale) for reindex to move.
+  void index_node( files & fls, files::const_iterator pit, name payer, name filename, uint64_t nodeid,
+		   uint32_t size, const checksum256 & hash ) {
+    offsets ofs( _self, index_scope( *pit, filename ) );
+    auto oit = ofs.lower_bound( nodeid );
+    if ( oit != ofs.end() && oit->id == nodeid ) {
+      bool moved = oit->size != size;
+      ofs.modify( oit, same_payer, [&]( auto& o ) {
+	o.size = size;
+	o.hash = hash;
+      });
+      if ( moved && ++oit != ofs.end() )
+	move_offsets( fls, pit, filename, nodeid + 1 );
+      return;
+    }
+    bool inserted = oit != ofs.end();
+    uint64_t next = 0;
+    uint64_t offset = 0;
+    if ( oit != ofs.begin() ) {
+      --oit;
+      next = oit->id + 1;
+      offset = oit->offset + oit->size;
+    }
+    bool sparse = is_sparse( *pit );
+    if ( ! inserted && ( sparse ? next_node_id( filename, next ) : next ) != nodeid )
+      return;
+    ofs.emplace( payer, [&]( auto& o ) {
+      o.id = nodeid;
+      o.offset = offset;
+      o.size = size;
+      o.hash = hash;
+    });
+    if ( inserted )
+      move_offsets( fls, pit, filename, nodeid + 1 );
+    else if ( nodeid + 1 < pit->top )
+      index_nodes( ofs, payer, filename, sparse, INDEX_WRITE_LIMIT );
+  }
+
+  // Flags the offsets of the byte offset index records of a file from node id on as stale,
+  //   and moves up to INDEX_WRITE_LIMIT of them right away, so that the index of a file
+  //   with few nodes after a changed one is never left stale.
+  void move_offsets( files & fls, files::const_iterator pit, name filename, uint64_t id ) {
+    mark_stale( fls, pit, filename, id );
+    uint32_t max_rows = INDEX_WRITE_LIMIT;
+    fix_offsets( fls, pit, filename, max_rows );
+  }
+
+  // Flags the offsets of the byte offset index records of a file from node id on as stale:
+  //   past what move_offsets moves, they are not moved by a node size change, which would
+  //   take a write per record, but by reindex, a bounded step at a time (see fix_offsets).
+  void mark_stale( files & fls, files::const_iterator pit, name filename, uint64_t id ) {
+    uint64_t stale = pit->stale_offsets.value_or( 0 );
+    if ( stale != 0 && stale <= id )
+      return;
+    fls.modify( pit, same_payer, [&]( auto& p ) {
+      extend( p );
+      p.stale_offsets.emplace( id );
+    });
+  }
+
+  // Fixes up to max_rows stale offsets of a file's byte offset index (see mark_stale), in
+  //   node id order, and takes the number of records visited off max_rows.
+  void fix_offsets( files & fls, files::const_iterator pit, name filename, uint32_t & max_rows ) {
+    uint64_t stale = pit->stale_offsets.value_or( 0 );
+    if ( stale == 0 )
+      return;
+    offsets ofs( _self, index_scope( *pit, filename ) );
+    auto oit = ofs.lower_bound( stale );
+    uint64_t offset = 0;
+    if ( oit != ofs.begin() ) {
+      auto prev = oit;
+      --prev;
+      offset = prev->offset + prev->size;
+    }
+    for ( ; oit != ofs.end() && max_rows > 0; --max_rows, ++oit ) {
+      if ( oit->offset != offset ) {
+	ofs.modify( oit, same_payer, [&]( auto& o ) {
+	  o.offset = offset;
+	});
+      }
+      offset += oit->size;
+    }
+    stale = oit != ofs.end() ? oit->id : 0;
+    fls.modify( pit, same_payer, [&]( auto& p ) {
+      p.stale_offsets.emplace( stale );
+    });
+  }
+
+  // Indexes up to max_rows nodes that directly follow the last indexed node. Indexing stops
+  //   at the first missing node (e.g. one not yet uploaded to a reserved file), so the index
+  //   always covers a run of nodes from node 0 without gaps. In a sparse file (see setsparse)
+  //   it goes on past free node ids, to the next node.
+  void index_nodes( offsets & ofs, name payer, name filename, bool sparse, uint32_t max_rows ) {
+    uint64_t nodeid = 0;
+    uint64_t offset = 0;
+    auto oit = ofs.end();
+    if ( oit != ofs.begin() ) {
+      --oit;
+      nodeid = oit->id + 1;
+      offset = oit->offset + oit->size;
+    }
+    for ( ; max_rows > 0; --max_rows, ++nodeid ) {
+      uint32_t size;
+      checksum256 hash;
+      if ( ! node_digest( filename, nodeid, size, hash ) ) {
+	if ( ! sparse )
+	  break;
+	nodeid = next_node_id( filename, nodeid );
+	if ( ! node_digest( filename, nodeid, size, hash ) )
+	  break;
+      }
+      ofs.emplace( payer, [&]( auto& o ) {
+	o.id = nodeid;
+	o.offset = offset;
+	o.size = size;
+	o.hash = hash;
+      });
+      offset += size;
+    }
+  }
+
+  // Data size and hash of a node. For a node that a clone shares with its base, these come
+  //   from the base's byte offset index if it has them, so the data isn't loaded.
+  // Returns false if there is no such node.
+  bool node_digest( name filename, uint64_t nodeid, uint32_t & size, checksum256 & hash ) {
+    int32_t itr = internal_use_do_not_use::db_find_i64( _self.value, filename.value, "nodes"_n.value, nodeid );
+    if ( itr < 0 ) {
+      files fls( _self, filename.value );
+      files::const_iterator pit = fls.begin();
+      if ( pit == fls.end() || nodeid >= pit->shared.value_or( 0 ) )
+	return false;
+      offsets bofs( _self, index_scope( pit->base.value() ) );
+      auto oit = bofs.find( nodeid );
+      if ( oit == bofs.end() )
+	return node_digest( pit->base.value(), nodeid, size, hash );
+      size = oit->size;
+      hash = oit->hash;
+      return true;
+    }
+    uint64_t blobid;
+    size = node_data_size( itr, &blobid );
+    if ( blobid != 0 ) {
+      blobs bls( _self, _self.value );
+      hash = bls.get( blobid, "Blob does not exist." ).hash;
+    } else {
+      vector<char> row = get_node_row( itr, blobid );
+      hash = sha256( row.data() + row.size() - size, size );
+    }
+    return true;
+  }
+
+  // Finds the node that holds byte offset of a file, and the offset of its first byte
+  //   (start). Uses the byte offset index, then walks the length prefixes of any nodes
+  //   past the end of the index. Returns the node id after the last node if the offset
+  //   is past the end of the file.
+  // While the index has stale offsets (see mark_stale), the "byoffset" index can't be
+  //   trusted, and the records before them are binary searched by node id instead.
+  uint64_t find_node( name filename, uint64_t offset, uint64_t & start, bool sparse ) {
+    files fls( _self, filename.value );
+    files::const_iterator pit = fls.begin();
+    offsets ofs( _self, index_scope( *pit, filename ) );
+    uint64_t stale = pit->stale_offsets.value_or( 0 );
+    uint64_t nodeid = 0;
+    start = 0;
+    if ( stale == 0 ) {
+      auto idx = ofs.get_index<"byoffset"_n>();
+      auto oit = idx.upper_bound( offset );
+      if ( oit != idx.begin() ) {
+	--oit;
+	nodeid = oit->id;
+	start = oit->offset;
+      }
+    } else {
+      for ( uint64_t lo = 0, hi = stale; lo < hi; ) {
+	uint64_t mid = lo + ( hi - lo ) / 2;
+	auto oit = ofs.lower_bound( mid );
+	if ( oit == ofs.end() || oit->id >= hi || oit->offset > offset ) {
+	  hi = mid;
+	} else {
+	  nodeid = oit->id;
+	  start = oit->offset;
+	  lo = nodeid + 1;
+	}
+      }
+    }
+    for ( ;; ++nodeid ) {
+      int32_t itr = find_next_node_row( filename, nodeid, sparse );
+      if ( itr < 0 )
+	return nodeid;
+      uint32_t size = node_data_size( itr );
+      if ( offset < start + size )
+	return nodeid;
+      start += size;
+    }
+  }
+
+  // Hashes up to max_rows more nodes of a published file, in node id order, into the
+  //   Merkle tree progress m, and stores m as the file's merkle_state, paid for by payer.
+  //   Once every node is hashed, sets file::root, which setpub and commit have given the
+  //   file row already, so that the row doesn't grow.
+  void merkle_step( files & fls, files::const_iterator pit, name payer, name filename, merkle_state m, uint32_t max_rows ) {
+    if ( is_inline( *pit ) ) {
+      if ( m.next == 0 ) {
+	merkle_push( m, merkle_leaf( inline_hash( *pit ) ), 0, payer, filename );
+	m.next = 1;
+      }
+    } else {
+      name store = live_store( *pit, filename );
+      offsets ofs( _self, index_scope( *pit, filename ) );
+      bool sparse = is_sparse( *pit );
+      for ( ; m.next < pit->top && max_rows > 0; --max_rows, ++m.next ) {
+	int32_t itr = find_next_node_row( store, m.next, sparse );
+	if ( itr < 0 && sparse )
+	  break;
+	check( itr >= 0, "Node does not exist." );
+	merkle_push( m, merkle_leaf( node_hash( ofs, store, m.next ) ), m.next, payer, filename );
+      }
+    }
+    if ( m.next >= pit->top ) {
+      checksum256 root = merkle_fold( m );
+      fls.modify( pit, same_payer, [&]( auto& p ) {
+	p.root.emplace( root );
+      });
+    }
+    merkles mks( _self, filename.value );
+    mks.emplace( payer, [&]( auto& r ) {
+      r = m;
+    });
+  }
+
+  // Erases a file's Merkle progress record, if it has one.
+  void drop_merkle( name filename ) {
+    merkles mks( _self, filename.value );
+    auto mit = mks.begin();
+    if ( mit != mks.end() )
+      mks.erase( mit );
+  }
+
+  // Kept root of a file's Merkle subtree of height with the given index (see subtree).
+  subtree kept_subtree( name filename, uint32_t height, uint64_t index ) {
+    subtrees sts( _self, filename.value );
+    return sts.get( uint64_t(height) << 32 | index, "Merkle subtree missing." );
+  }
+
+  // Keeps the root of a file's Merkle subtree of height with the given index, whose first
+  //   leaf is that of node first, paid for by payer.
+  void keep_subtree( name payer, name filename, uint32_t height, uint64_t index, uint64_t first, const checksum256 & hash ) {
+    subtrees sts( _self, filename.value );
+    uint64_t id = uint64_t(height) << 32 | index;
+    auto sit = sts.find( id );
+    if ( sit == sts.end() ) {
+      sts.emplace( payer, [&]( auto& r ) {
+	r.id = id;
+	r.first = first;
+	r.hash = hash;
+      });
+    } else {
+      sts.modify( sit, payer, [&]( auto& r ) {
+	r.first = first;
+	r.hash = hash;
+      });
+    }
+  }
+
+  // Position of node nodeid among the leaves of the Merkle tree of a file (not inline).
+  // In a sparse file, the kept subtrees of MERKLE_SUBTREE_HEIGHT are binary searched for
+  //   the last one whose first node is at or before nodeid, and the nodes from there on
+  //   are walked, into the smaller subtree at the end if need be.
+  uint64_t merkle_position( const file & f, name filename, uint64_t nodeid, uint64_t leaves ) {
+    name store = live_store( f, filename );
+    if ( ! is_sparse( f ) ) {
+      check( nodeid < leaves && find_node_row( store, nodeid ) >= 0, "Node does not exist." );
+      return nodeid;
+    }
+    uint64_t lo = 0;
+    for ( uint64_t hi = leaves >> MERKLE_SUBTREE_HEIGHT; lo < hi; ) {
+      uint64_t mid = lo + ( hi - lo ) / 2;
+      if ( kept_subtree( filename, MERKLE_SUBTREE_HEIGHT, mid ).first <= nodeid )
+	lo = mid + 1;
+      else
+	hi = mid;
+    }
+    uint64_t leaf = 0;
+    uint64_t id = 0;
+    if ( lo > 0 ) {
+      leaf = ( lo - 1 ) << MERKLE_SUBTREE_HEIGHT;
+      id = kept_subtree( filename, MERKLE_SUBTREE_HEIGHT, lo - 1 ).first;
+    }
+    for ( ; leaf < leaves; ++leaf, ++id ) {
+      check( find_next_node_row( store, id, true ) >= 0, "Node does not exist." );
+      if ( id >= nodeid )
+	break;
+    }
+    check( leaf < leaves && id == nodeid, "Node does not exist." );
+    return leaf;
+  }
+
+  // Merkle tree leaves of a file's subtree of MERKLE_SUBTREE_HEIGHT with the given index,
+  //   of which the last one, at the end of the file's leaves, may have fewer.
+  vector<checksum256> merkle_block( const file & f, name filename, uint64_t index, uint64_t leaves ) {
+    name store = live_store( f, filename );
+    offsets ofs( _self, index_scope( f, filename ) );
+    bool sparse = is_sparse( f );
+    uint64_t first = index << MERKLE_SUBTREE_HEIGHT;
+    uint64_t id = first;
+    if ( sparse ) {
+      // A kept subtree gives its first node. The last, smaller subtree starts past the nodes
+      //   of the kept one before it.
+      id = 0;
+      if ( index < leaves >> MERKLE_SUBTREE_HEIGHT ) {
+	id = kept_subtree( filename, MERKLE_SUBTREE_HEIGHT, index ).first;
+      } else if ( index > 0 ) {
+	id = kept_subtree( filename, MERKLE_SUBTREE_HEIGHT, index - 1 ).first;
+	for ( uint64_t skip = MERKLE_SUBTREE_LEAVES; skip > 0; --skip, ++id )
+	  check( find_next_node_row( store, id, true ) >= 0, "Node does not exist." );
+      }
+    }
+    vector<checksum256> level;
+    for ( uint64_t count = std::min<uint64_t>( MERKLE_SUBTREE_LEAVES, leaves - first ); level.size() < count; ++id ) {
+      check( find_next_node_row( store, id, sparse ) >= 0, "Node does not exist." );
+      level.push_back( merkle_leaf( node_hash( ofs, store, id ) ) );
+    }
+    return level;
+  }
+
+  // Merkle root of a file's leaves from first up to end, which are the leaves of a subtree
+  //   at or above MERKLE_SUBTREE_HEIGHT, with end cut short at the end of the file's leaves:
+  //   the kept roots of the perfect subtrees that make it up, largest first, and the root of
+  //   the leaves of any smaller subtree at the end, merged from the smallest up (see
+  //   merkle_fold).
+  checksum256 merkle_range( const file & f, name filename, uint64_t first, uint64_t end, uint64_t leaves ) {
+    vector<checksum256> roots;
+    while ( end - first >= MERKLE_SUBTREE_LEAVES ) {
+      uint32_t height = MERKLE_SUBTREE_HEIGHT;
+      while ( ( uint64_t(2) << height ) <= end - first )
+	++height;
+      roots.push_back( kept_subtree( filename, height, first >> height ).hash );
+      first += uint64_t(1) << height;
+    }
+    if ( first < end ) {
+      vector<checksum256> level = merkle_block( f, filename, first >> MERKLE_SUBTREE_HEIGHT, leaves );
+      while ( level.size() > 1 )
+	merkle_level( level );
+      roots.push_back( level[0] );
+    }
+    checksum256 root = roots.back();
+    for ( size_t i = roots.size() - 1; i-- > 0; )
+      root = merkle_node( roots[i], root );
+    return root;
+  }
+
+  // sha256 of the data of a node: the hash kept in the node's byte offset index record if
+  //   it has one, or else computed (see node_digest), so the index doesn't need to be complete.
+  checksum256 node_hash( offsets & ofs, name filename, uint64_t nodeid ) {
+    auto oit = ofs.find( nodeid );
+    if ( oit != ofs.end() )
+      return oit->hash;
+    uint32_t size;
+    checksum256 hash;
+    check( node_digest( filename, nodeid, size, hash ), "Node does not exist." );
+    return hash;
+  }
+
+  // sha256 of the data of an inline file (see set_inline).
+  static checksum256 inline_hash( const file & f ) {
+    return sha256( reinterpret_cast<const char*>( f.inline_data.value().data() ), f.inline_data.value().size() );
+  }
+
+  // sha256 of the data of a hole (see sethole) of size bytes.
+  static checksum256 hole_hash( uint32_t size ) {
+    vector<char> zeros( size );
+    return sha256( zeros.data(), zeros.size() );
+  }
+
+  // Merkle tree leaf of a node with the given data hash: the sha256 of a 0x00 byte followed
+  //   by the hash. The prefix byte (as in RFC 6962) keeps a leaf from ever being taken for
+  //   an inner node (see merkle_node), e.g. that of a 64-byte node made of two hashes.
+  static checksum256 merkle_leaf( const checksum256 & hash ) {
+    std::array<uint8_t, 33> leaf;
+    auto bytes = hash.extract_as_byte_array();
+    leaf[0] = 0x00;
+    std::copy( bytes.begin(), bytes.end(), leaf.begin() + 1 );
+    return sha256( reinterpret_cast<const char*>( leaf.data() ), leaf.size() );
+  }
+
+  // Merkle tree node above two hashes: the sha256 of a 0x01 byte followed by both.
+  static checksum256 merkle_node( const checksum256 & left, const checksum256 & right ) {
+    std::array<uint8_t, 65> pair;
+    auto lbytes = left.extract_as_byte_array();
+    auto rbytes = right.extract_as_byte_array();
+    pair[0] = 0x01;
+    std::copy( lbytes.begin(), lbytes.end(), pair.begin() + 1 );
+    std::copy( rbytes.begin(), rbytes.end(), pair.begin() + 33 );
+    return sha256( reinterpret_cast<const char*>( pair.data() ), pair.size() );
+  }
+
+  // Replaces a level of Merkle tree hashes with the level above it: each pair of hashes is
+  //   replaced by their merkle_node, and an odd last hash is moved up as-is.
+  static void merkle_level( vector<checksum256> & level ) {
+    size_t up = 0;
+    for ( size_t i = 0; i < level.size(); i += 2, ++up )
+      level[up] = i + 1 == level.size() ? level[i] : merkle_node( level[i], level[i + 1] );
+    level.resize( up );
+  }
+
+  // Adds the leaf of node nodeid to a file's Merkle tree progress: the leaf is merged with
+  //   the roots of the equal sized subtrees before it, as many as the trailing one bits of
+  //   m.leaves. The roots of the subtrees so completed from MERKLE_SUBTREE_HEIGHT up are
+  //   kept (see subtree), paid for by payer.
+  void merkle_push( merkle_state & m, checksum256 leaf, uint64_t nodeid, name payer, name filename ) {
+    if ( m.leaves % MERKLE_SUBTREE_LEAVES == 0 )
+      m.first = nodeid;
+    uint32_t height = 0;
+    for ( uint64_t n = m.leaves; n & 1; n >>= 1 ) {
+      leaf = merkle_node( m.frontier.back(), leaf );
+      m.frontier.pop_back();
+      if ( ++height >= MERKLE_SUBTREE_HEIGHT )
+	keep_subtree( payer, filename, height, m.leaves >> height, height == MERKLE_SUBTREE_HEIGHT ? m.first : 0, leaf );
+    }
+    m.frontier.push_back( leaf );
+    ++m.leaves;
+  }
+
+  // Merkle root of the leaves of a Merkle tree progress: the roots of its subtrees merged
+  //   from the smallest up, which is the tree that merkle_level builds level by level (an
+  //   odd last hash moved up is a smaller subtree merged later). All zeroes for no leaves.
+  static checksum256 merkle_fold( const merkle_state & m ) {
+    if ( m.frontier.empty() )
+      return checksum256();
+    checksum256 root = m.frontier.back();
+    for ( size_t i = m.frontier.size() - 1; i-- > 0; )
+      root = merkle_node( m.frontier[i], root );
+    return root;
+  }
+
+  // Total data size of a file, of the nodes counted so far for a file that predates
+  //   file::total_bytes (see count_bytes).
+  static uint64_t file_bytes( const file & f ) {
+    return f.total_bytes.value_or( 0 );
+  }
+
+  // First node id whose data size a file's total_bytes doesn't count yet (see count_bytes),
+  //   or BYTES_COUNTED. A file that predates file::total_bytes has no node counted, unless
+  //   it has no nodes at all.
+  static uint64_t uncounted_node( const file & f ) {
+    if ( f.total_bytes.has_value() )
+      return f.uncounted.value_or( BYTES_COUNTED );
+    return f.top > 0 ? 0 : BYTES_COUNTED;
+  }
+
+  // The part of a change of size bytes to node nodeid that a file's total_bytes takes in:
+  //   all of it, or none for a node that count_bytes has yet to count.
+  static uint64_t counted( const file & f, uint64_t nodeid, uint64_t size ) {
+    return nodeid < uncounted_node( f ) ? size : 0;
+  }
+
+  // Counts up to max_rows nodes of a file that predates file::total_bytes, or of its
+  //   pending stage if it has one, into its total_bytes, from where the last call left off,
+  //   and takes the number of nodes visited off max_rows.
+  // Only a file row that has every extension field is counted, so that the row doesn't
+  //   grow: a file gets them on any change by its owner.
+  void count_bytes( name filename, uint32_t & max_rows ) {
+    files fls( _self, filename.value );
+    files::const_iterator pit = fls.begin();
+    uint8_t staged = pit->staged.value_or( 0 );
+    if ( staged != 0 ) {
+      count_bytes( name( filename.value | staged ), max_rows );
+      return;
+    }
+    uint64_t next = uncounted_node( *pit );
+    if ( next == BYTES_COUNTED || ! pit->uncounted.has_value() )
+      return;
+    name store = live_store( *pit, filename );
+    bool sparse = is_sparse( *pit );
+    uint64_t bytes = file_bytes( *pit );
+    for ( ; next < pit->top && max_rows > 0; --max_rows, ++next ) {
+      int32_t itr = find_next_node_row( store, next, sparse );
+      if ( itr >= 0 )
+	bytes += node_data_size( itr );
+    }
+    fls.modify( pit, same_payer, [&]( auto& p ) {
+      p.total_bytes.emplace( bytes );
+      p.uncounted.emplace( next < p.top ? next : BYTES_COUNTED );
+    });
+  }
+
+  // Gives every extension field of a file row a value, so that any of them can be set
+  //   without leaving an earlier one missing (which would make the packed row unreadable).
+  static void extend( file & f ) {
+    uint64_t first_uncounted = uncounted_node( f );
+    f.status.emplace( f.status.value_or( FILE_READY ) );
+    f.reserved.emplace( f.reserved.value_or( 0 ) );
+    f.arrived.emplace( f.arrived.value_or( 0 ) );
+    f.total_bytes.emplace( file_bytes( f ) );
+    f.root.emplace( f.root.value_or( checksum256() ) );
+    f.base.emplace( f.base.value_or( name() ) );
+    f.shared.emplace( f.shared.value_or( 0 ) );
+    if ( ! f.inline_data.has_value() )
+      f.inline_data.emplace();
+    f.staged.emplace( f.staged.value_or( 0 ) );
+    f.overlay.emplace( f.overlay.value_or( 0 ) );
+    f.index_gen.emplace( f.index_gen.value_or( 0 ) );
+    f.sparse.emplace( f.sparse.value_or( false ) );
+    f.stale_offsets.emplace( f.stale_offsets.value_or( 0 ) );
+    f.uncounted.emplace( first_uncounted );
+  }
+
+  // Checks that nodes [first, end) can be set: up to the top node, anywhere within the
+  //   reserved node count of a reserved file, or a single existing node of a sparse file.
+  // end is computed by the caller as first plus the node count, so a run that wrapped
+  //   around past the largest node id (end <= first) is rejected before anything else.
+  void check_node_run( const file & f, name filename, uint64_t first, uint64_t end ) {
+    check( first < end && end <= UINT32_MAX, "Invalid node id." );
+    uint32_t reserved = f.reserved.value_or( 0 );
+    if ( reserved > 0 ) {
+      check( end <= reserved, "Past reserved nodes." );
+    } else if ( is_sparse( f ) ) {
+      check( end == first + 1, "File is sparse." );
+      check( find_node_row( filename, first ) >= 0, "Node does not exist." );
+    } else {
+      check( first <= f.top, "Past top." );
+    }
+  }
+
+  // Id of the first of count nodes appended to a file: its top, or for a sparse file, the
+  //   next multiple of SPARSE_GAP above its top, with the nodes SPARSE_GAP apart.
+  static uint64_t append_node_id( const file & f, uint32_t count ) {
+    if ( ! is_sparse( f ) )
+      return f.top;
+    uint64_t first = ( f.top / SPARSE_GAP + 1 ) * SPARSE_GAP;
+    check( first + SPARSE_GAP * ( count - 1 ) < UINT32_MAX, "Sparse file full." );
+    return first;
+  }
+
+  // Flags a node of a reserved file as arrived.
+  void set_arrived( bitmaps & bms, name payer, uint64_t nodeid ) {
+    uint64_t bit = 1ull << (nodeid % 64);
+    auto bit_it = bms.find( nodeid / 64 );
+    if ( bit_it == bms.end() ) {
+      bms.emplace( payer, [&]( auto& b ) {
+	b.id = nodeid / 64;
+	b.bits = bit;
+      });
+    } else {
+      bms.modify( bit_it, same_payer, [&]( auto& b ) {
+	b.bits |= bit;
+      });
+    }
+  }
+
+  // Erases up to max_rows nodes of a file (or stage) from its top node down to node top,
+  //   and updates the file row once. Returns the file's new top: top, or the id of the
+  //   last node erased if max_rows ran out first. A file left with a single small node is
+  //   made inline.
+  uint64_t pop_nodes( files & fls, files::const_iterator pit, name filename, uint64_t top, uint32_t max_rows ) {
+    if ( is_inline( *pit ) ) {
+      fls.modify( pit, same_payer, [&]( auto& p ) {
+	p.top = 0;
+	p.published = false;
+	p.total_bytes.emplace( 0 );
+	p.inline_data.value().clear();
+      });
+      return 0;
+    }
+    uint64_t bytes = file_bytes( *pit );
+    bool sparse = is_sparse( *pit );
+    offsets ofs( _self, index_scope( *pit, filename ) );
+    uint64_t end = pit->top;
+    for ( ; end > top && max_rows > 0; --max_rows ) {
+      uint64_t nodeid = end - 1;
+      if ( sparse && ( ! last_node_id( filename, end, nodeid ) || nodeid < top ) ) {
+	end = top;
+	break;
+      }
+      end = nodeid;
+      int32_t itr = internal_use_do_not_use::db_find_i64( _self.value, filename.value, "nodes"_n.value, nodeid );
+      uint64_t blobid;
+      bytes -= counted( *pit, nodeid, node_data_size( itr >= 0 ? itr : find_base_node( filename, nodeid ), &blobid ) );
+      if ( itr >= 0 ) {
+	internal_use_do_not_use::db_remove_i64( itr );
+	if ( blobid != 0 )
+	  unref_blob( blobid );
+      }
+      auto oit = ofs.find( nodeid );
+      if ( oit != ofs.end() )
+	ofs.erase( oit );
+    }
+    fls.modify( pit, same_payer, [&]( auto& p ) {
+      p.top = end;
+      p.published = false;
+      extend( p );
+      p.total_bytes.emplace( bytes );
+      if ( p.shared.value() > end )
+	p.shared.emplace( end );
+      if ( p.stale_offsets.value() >= end )
+	p.stale_offsets.emplace( 0 );
+    });
+    if ( end == 1 )
+      pull_inline( fls, pit, filename );
+    return end;
+  }
+
+  // Whether a file has sparse node ids (see setsparse).
+  static bool is_sparse( const file & f ) {
+    return f.sparse.value_or( false );
+  }
+
+  // Whether a file keeps its only node inline (see set_inline).
+  static bool is_inline( const file & f ) {
+    return f.inline_data.has_value() && ! f.inline_data.value().empty();
+  }
+
+  // Whether node 0 of a file, with size bytes of data, can be kept inline: the file must
+  //   have no other node, not be reserved or sparse and not share nodes with a base file.
+  bool fits_inline( const file & f, uint32_t size ) {
+    if ( f.top > 1 || f.reserved.value_or( 0 ) > 0 || f.shared.value_or( 0 ) > 0 || is_sparse( f ) )
+      return false;
+    return size <= get_config().inline_max;
+  }
+
+  // Makes a file inline, with data as its only node: the data is kept in the file row
+  //   instead of a node row, so reading a small file takes a single table lookup and the
+  //   file needs no nodes or offsets records. Any node 0 row the file had is erased.
+  void set_inline( files & fls, files::const_iterator pit, name filename, const char * data, uint32_t size ) {
+    int32_t itr = internal_use_do_not_use::db_find_i64( _self.value, filename.value, "nodes"_n.value, 0 );
+    if ( itr >= 0 ) {
+      uint64_t blobid;
+      node_data_size( itr, &blobid );
+      internal_use_do_not_use::db_remove_i64( itr );
+      if ( blobid != 0 )
+	unref_blob( blobid );
+    }
+    offsets ofs( _self, index_scope( *pit, filename ) );
+    auto oit = ofs.find( 0 );
+    if ( oit != ofs.end() )
+      ofs.erase( oit );
+    fls.modify( pit, same_payer, [&]( auto& p ) {
+      p.published = false;
+      p.top = 1;
+      extend( p );
+      p.total_bytes.emplace( size );
+      p.uncounted.emplace( BYTES_COUNTED );
+      p.inline_data.value().assign( data, data + size );
+      p.stale_offsets.emplace( 0 );
+    });
+  }
+
+  // Makes a file with a single node inline if that node is small enough (see set_inline).
+  void pull_inline( files & fls, files::const_iterator pit, name filename ) {
+    int32_t itr = internal_use_do_not_use::db_find_i64( _self.value, filename.value, "nodes"_n.value, 0 );
+    if ( itr < 0 )
+      return;
+    uint32_t size = node_data_size( itr );
+    if ( ! fits_inline( *pit, size ) )
+      return;
+    uint64_t blobid;
+    vector<char> row = get_node_row( itr, blobid );
+    set_inline( fls, pit, filename, row.data() + row.size() - size, size );
+  }
+
+  // Moves the data of an inline file out to a node 0 row, before any other node change.
+  void spill_inline( files & fls, files::const_iterator pit, name owner, name filename ) {
+    if ( ! is_inline( *pit ) )
+      return;
+    node n{ 0, pit->inline_data.value() };
+    vector<char> row = pack( n );
+    store_node_row( owner, filename, 0, row.data(), row.size() );
+    index_node( fls, pit, owner, filename, 0, n.data.size(), sha256( reinterpret_cast<const char*>( n.data.data() ), n.data.size() ) );
+    fls.modify( pit, same_payer, [&]( auto& p ) {
+      p.inline_data.value().clear();
+    });
+  }
+
+  // Reads a whole row through a database iterator, without unpacking it.
+  vector<char> get_row( int32_t itr ) {
+    check( itr >= 0, "Node does not exist." );
+    vector<char> row( internal_use_do_not_use::db_get_i64( itr, nullptr, 0 ) );
+    internal_use_do_not_use::db_get_i64( itr, row.data(), row.size() );
+    return row;
+  }
+
+  // Stores a packed node row for a node that is known not to exist yet.
+  void store_node_row( name owner, name filename, uint64_t nodeid, const char * row, uint32_t size ) {
+    internal_use_do_not_use::db_store_i64( filename.value, "nodes"_n.value, owner.value, nodeid, row, size );
+    note_payer( owner, filename, nodeid );
+  }
+
+  // Records who pays for the new row of node nodeid of a stage (see row_payer), if that
+  //   isn't the stage's owner. Does nothing for a file's own scope.
+  void note_payer( name payer, name store, uint64_t nodeid ) {
+    if ( ( store.value & GEN_MASK ) == 0 )
+      return;
+    files sfls( _self, store.value );
+    bool owned = sfls.begin()->owner == payer;
+    row_payers rps( _self, store.value );
+    auto rit = rps.find( nodeid );
+    if ( rit == rps.end() ) {
+      if ( ! owned ) {
+	rps.emplace( payer, [&]( auto& r ) {
+	  r.id = nodeid;
+	  r.payer = payer;
+	});
+      }
+    } else if ( owned ) {
+      rps.erase( rit );
+    } else if ( rit->payer != payer ) {
+      rps.modify( rit, payer, [&]( auto& r ) {
+	r.payer = payer;
+      });
+    }
+  }
+
+  // File status values (file::status). A file that has no status is FILE_READY.
+  static constexpr uint8_t FILE_READY = 0;
+  static constexpr uint8_t FILE_RESETTING = 1;
+  static constexpr uint8_t FILE_DELETING = 2;
+
+  // file::uncounted of a file whose total_bytes counts every node.
+  static constexpr uint64_t BYTES_COUNTED = UINT64_MAX;
+
+  // Default config::inline_max, for when the contract has no configuration: inline
+  //   storage is opt-in (see setconfig).
+  static constexpr uint32_t DEFAULT_INLINE_MAX = 0;
+
+  // Default config::feed_window.
+  static constexpr uint32_t DEFAULT_FEED_WINDOW = 1000;
+
+  // Change feed record kinds (change::kind).
+  static constexpr uint8_t CHANGE_CREATE = 0;
+  static constexpr uint8_t CHANGE_SETNODE = 1;
+  static constexpr uint8_t CHANGE_DELNODE = 2;
+  static constexpr uint8_t CHANGE_RESET = 3;
+  static constexpr uint8_t CHANGE_DEL = 4;
+  static constexpr uint8_t CHANGE_SETPUB = 5;
+  static constexpr uint8_t CHANGE_SETIMMUTABLE = 6;
+  static constexpr uint8_t CHANGE_CLONE = 7;
+  static constexpr uint8_t CHANGE_COMMIT = 8;
+  static constexpr uint8_t CHANGE_TRUNCATE = 9; // nodeid is the new top
+  static constexpr uint8_t CHANGE_INSERTNODE = 10;
+
+  // Maximum number of subscribers (see setsubs).
+  static constexpr uint32_t MAX_SUBSCRIBERS = 16;
+
+  // Maximum number of old change feed records pruned per new record, so that shrinking
+  //   config::feed_window doesn't make any single action prune the whole excess.
+  static constexpr uint32_t FEED_PRUNE_LIMIT = 2;
+
+  // Bits of a name value that are 0 in every file name and hold the generation in the
+  //   name of a stage (see stage).
+  static constexpr uint64_t GEN_MASK = 0xF;
+
+  // Highest generation of a file's data (see stage); generation 0 is the file's own scope.
+  static constexpr uint8_t MAX_GEN = 2;
+
+  // Maximum number of nodes that reset and del will clear by themselves.
+  static constexpr uint32_t CLEAR_NODES_LIMIT = 256;
+
+  // Maximum number of nodes that truncate will erase per call.
+  static constexpr uint32_t TRUNCATE_NODES_LIMIT = 256;
+
+  // Spacing of the node ids that append and appendnodes give the nodes of a sparse file,
+  //   which leaves room for 16 levels of inserts between two appended nodes.
+  static constexpr uint64_t SPARSE_GAP = 1ull << 16;
+
+  // Largest virtual node (see sethole and setrefnode). Reading or hashing a virtual node
+  //   expands it to its data in memory.
+  static constexpr uint32_t MAX_VIRTUAL_SIZE = 1 << 20;
+
+  // Maximum number of byte offset index records, other than its own, that a node write
+  //   adds or moves (see index_node).
+  static constexpr uint32_t INDEX_WRITE_LIMIT = 16;
+
+  // Maximum number of nodes that setpub and commit hash into the Merkle root by themselves.
+  static constexpr uint32_t MERKLE_NODES_LIMIT = 16;
+
+  // Height of the smallest Merkle subtrees whose roots are kept (see subtree). proof hashes
+  //   the leaves of one such subtree of MERKLE_SUBTREE_LEAVES nodes, and reads kept roots
+  //   for the rest of the path.
+  static constexpr uint32_t MERKLE_SUBTREE_HEIGHT = 4;
+  static constexpr uint64_t MERKLE_SUBTREE_LEAVES = uint64_t(1) << MERKLE_SUBTREE_HEIGHT;
+
+  // Erases up to max_rows node, bitmap, uploader, Merkle progress and subtree, row payer and
+  //   offset records of a file (or stage), lowest ids first, releasing the shared blobs referenced by erased nodes.
+  //   Returns true if none are left.
+  bool clear_nodes( name filename, uint32_t max_rows ) {
+    return clear_table( "nodes"_n, filename, max_rows )
+      && clear_table( "bitmaps"_n, filename, max_rows )
+      && clear_table( "uploaders"_n, filename, max_rows )
+      && clear_table( "merkles"_n, filename, max_rows )
+      && clear_table( "subtrees"_n, filename, max_rows )
+      && clear_table( "payers"_n, filename, max_rows )
+      && clear_offsets( index_scope( filename ), max_rows );
+  }
+
+  // Erases up to max_rows records of a table scope through the database intrinsics, so
+  //   that they are never loaded, and takes the erased count off max_rows.
+  // Only for tables without secondary indexes, whose entries db_remove_i64 would leave
+  //   behind (see clear_offsets).
+  bool clear_table( name table, name filename, uint32_t & max_rows ) {
+    int32_t itr = internal_use_do_not_use::db_lowerbound_i64( _self.value, filename.value, table.value, 0 );
+    for ( ; itr >= 0 && max_rows > 0; --max_rows ) {
+      uint64_t id;
+      int32_t next = internal_use_do_not_use::db_next_i64( itr, &id );
+      uint64_t blobid = 0;
+      if ( table == "nodes"_n )
+	node_data_size( itr, &blobid );
+      internal_use_do_not_use::db_remove_i64( itr );
+      if ( blobid != 0 )
+	unref_blob( blobid );
+      itr = next;
+    }
+    return itr < 0;
+  }
+
+  // Same as clear_table for the byte offset index records of a scope, which are erased
+  //   through offsets::erase so that their byoffset index entries go with them.
+  bool clear_offsets( uint64_t scope, uint32_t & max_rows ) {
+    offsets ofs( _self, scope );
+    auto oit = ofs.begin();
+    for ( ; oit != ofs.end() && max_rows > 0; --max_rows )
+      oit = ofs.erase( oit );
+    return oit == ofs.end();
+  }
+
+  // Checks that a name is that of a file, and not of a stage (filename | generation), whose
+  //   scope only the contract itself may change.
+  static void check_file_name( name filename ) {
+    check( ( filename.value & GEN_MASK ) == 0, "Invalid filename." );
+  }
+
+  // Checks that a file has no pending stage, nor a commit that gc has yet to merge.
+  void check_unstaged( const file & f ) {
+    check( f.staged.value_or( 0 ) == 0, "File is staged." );
+    check( f.overlay.value_or( 0 ) == 0, "Commit being merged." );
+  }
+
+  // Authorizes a change to the nodes of a file, and gives the name whose scope the change
+  //   goes to: that of the file's stage if it has one (see stage), or else the file's own.
+  name auth_and_find_store( name owner, name filename ) {
+    files fls( _self, filename.value );
+    files::const_iterator pit = auth_and_find_file( owner, filename, fls );
+    return write_store( *pit, filename );
+  }
+
+  // Same as auth_and_find_store for a change to nodes [first, end) of a file, which account
+  //   can make as the file's owner, or as an uploader whose node range holds them.
+  // A run that wrapped around past the largest node id (end <= first) is never held.
+  name auth_and_find_node_store( name account, name filename, uint64_t first, uint64_t end ) {
+    require_auth( account );
+    check_file_name( filename );
+    files fls( _self, filename.value );
+    files::const_iterator pit = fls.begin();
+    check( pit != fls.end(), "File does not exist." );
+    if ( pit->owner != account ) {
+      uploaders ups( _self, filename.value );
+      auto uit = ups.find( account.value );
+      check( uit != ups.end(), "Not file owner." );
+      check( first < end && first >= uit->first && end <= uit->end, "Past uploader nodes." );
+      check( pit->owner != name(), "File is immutable." );
+    }
+    check( pit->status.value_or( FILE_READY ) == FILE_READY, "File is being cleared." );
+    touch( account, filename, pit->owner );
+    return write_store( *pit, filename );
+  }
+
+  // Name whose scope changes to a file's nodes go to: that of the file's stage if it has
+  //   one, or else the file's own. Not while a commit is being merged.
+  static name write_store( const file & f, name filename ) {
+    check( f.overlay.value_or( 0 ) == 0, "Commit being merged." );
+    uint8_t gen = f.staged.value_or( 0 );
+    return gen == 0 ? filename : name( filename.value | gen );
+  }
+
+  // Name whose scope a file's current nodes are read from: that of a committed stage that
+  //   is still being merged (see commit), or else the file's own.
+  static name live_store( const file & f, name filename ) {
+    uint8_t gen = f.overlay.value_or( 0 );
+    return gen == 0 ? filename : name( filename.value | gen );
+  }
+
+  // Scope of the byte offset index of a file or stage (see file::index_gen).
+  static uint64_t index_scope( const file & f, name filename ) {
+    return filename.value | f.index_gen.value_or( 0 );
+  }
+
+  uint64_t index_scope( name filename ) {
+    files fls( _self, filename.value );
+    files::const_iterator pit = fls.begin();
+    return pit != fls.end() ? index_scope( *pit, filename ) : filename.value;
+  }
+
+  // Name of the file or stage whose byte offset index reindex updates: that of the file's
+  //   pending stage if it has one, or else live_store.
+  name index_store( name filename ) {
+    files fls( _self, filename.value );
+    files::const_iterator pit = fls.begin();
+    check( pit != fls.end(), "File does not exist." );
+    uint8_t staged = pit->staged.value_or( 0 );
+    return staged != 0 ? name( filename.value | staged ) : live_store( *pit, filename );
+  }
+
+  // Merges up to max_rows rows of a committed stage into its file (see commit): first
+  //   clears the file's old byte offset indexes and bitmaps, then the file's own node rows
+  //   that the stage doesn't share, then moves the stage's node rows into the file's scope.
+  // The file reads the same data at every step. Once done, the stage row is erased, the
+  //   stage's byte offset index stays on as the file's, the file is published, and true
+  //   is returned.
+  bool merge_stage( files & fls, files::const_iterator pit, name filename, uint32_t max_rows ) {
+    uint8_t gen = pit->overlay.value();
+    name store( filename.value | gen );
+    for ( uint8_t g = 0; g <= MAX_GEN; ++g ) {
+      if ( g != gen && ! clear_offsets( filename.value | g, max_rows ) )
+	return false;
+    }
+    if ( ! clear_table( "bitmaps"_n, filename, max_rows ) || ! clear_table( "bitmaps"_n, store, max_rows ) )
+      return false;
+
+    files sfls( _self, store.value );
+    files::const_iterator sit = sfls.begin();
+    int32_t itr = internal_use_do_not_use::db_lowerbound_i64( _self.value, filename.value, "nodes"_n.value, sit->shared.value() );
+    for ( ; itr >= 0 && max_rows > 0; --max_rows ) {
+      uint64_t nodeid;
+      int32_t next = internal_use_do_not_use::db_next_i64( itr, &nodeid );
+      uint64_t blobid;
+      node_data_size( itr, &blobid );
+      internal_use_do_not_use::db_remove_i64( itr );
+      if ( blobid != 0 )
+	unref_blob( blobid );
+      itr = next;
+    }
+    if ( itr >= 0 )
+      return false;
+    // The file's own scope has no rows past what the stage shares now, so rows can be
+    //   moved there from any node of the stage.
+    if ( sit->shared.value() < sit->top ) {
+      sfls.modify( sit, same_payer, [&]( auto& p ) {
+	p.shared.emplace( p.top );
+      });
+    }
+
+    // Each row keeps its payer (see row_payer), so that gc, which anyone can call, moves RAM
+    //   between the scopes of one account only. A file row that the stage row replaces is
+    //   erased rather than overwritten, as it may have another payer.
+    row_payers rps( _self, store.value );
+    itr = internal_use_do_not_use::db_lowerbound_i64( _self.value, store.value, "nodes"_n.value, 0 );
+    for ( ; itr >= 0 && max_rows > 0; --max_rows ) {
+      uint64_t nodeid;
+      int32_t next = internal_use_do_not_use::db_next_i64( itr, &nodeid );
+      vector<char> row = get_row( itr );
+      memcpy( &nodeid, row.data(), sizeof(nodeid) );
+      internal_use_do_not_use::db_remove_i64( itr );
+      name payer = sit->owner;
+      auto rit = rps.find( nodeid );
+      if ( rit != rps.end() ) {
+	payer = rit->payer;
+	rps.erase( rit );
+      }
+      int32_t fitr = internal_use_do_not_use::db_find_i64( _self.value, filename.value, "nodes"_n.value, nodeid );
+      if ( fitr >= 0 ) {
+	uint64_t blobid;
+	node_data_size( fitr, &blobid );
+	internal_use_do_not_use::db_remove_i64( fitr );
+	if ( blobid != 0 )
+	  unref_blob( blobid );
+      }
+      store_node_row( payer, filename, nodeid, row.data(), row.size() );
+      itr = next;
+    }
+    if ( itr >= 0 || ! clear_table( "payers"_n, store, max_rows ) )
+      return false;
+    sfls.erase( sit );
+    fls.modify( pit, same_payer, [&]( auto& p ) {
+      p.published = true;
+      p.overlay.emplace( 0 );
+    });
+    return true;
+  }
+
+  files::const_iterator auth_and_find_file( name owner, name filename, const files & fls ) {
+    require_auth( owner );
+    check_file_name( filename );
+    files::const_iterator pit = fls.begin();
+    check( pit != fls.end(), "File does not exist." );
+    check( pit->owner == owner, "Not file owner." );
+    check( pit->status.value_or( FILE_READY ) == FILE_READY, "File is being cleared." );
+    touch( owner, filename, owner );
+    return pit;
+  }
+
+  // Records a change to a file in the registry, adding the file if it isn't there yet.
+  void touch( name payer, name filename, name owner ) {
+    registry reg( _self, _self.value );
+    auto rit = reg.find( filename.value );
+    if ( rit == reg.end() ) {
+      reg.emplace( payer, [&]( auto& r ) {
+	r.filename = filename;
+	r.owner = owner;
+	r.modified = current_block_number();
+      });
+    } else {
+      reg.modify( rit, same_payer, [&]( auto& r ) {
+	r.owner = owner;
+	r.modified = current_block_number();
+      });
+    }
+  }
+
+  // Contract configuration, with defaults for anything not set.
+  config get_config() {
+    config_table cfg( _self, _self.value );
+    config c = cfg.get_or_default( config{ DEFAULT_INLINE_MAX } );
+    c.feed_window.emplace( c.feed_window.value_or( DEFAULT_FEED_WINDOW ) );
+    if ( ! c.subscribers.has_value() )
+      c.subscribers.emplace();
+    return c;
+  }
+
+  // Notifies the subscribers (see setsubs) of the current action.
+  void notify_subscribers() {
+    for ( name sub : get_config().subscribers.value() )
+      require_recipient( sub );
+  }
+
+  // Appends a record to the change feed, and prunes records past the window. Changes to a
+  //   stage (a store name with a generation) are not recorded, as the file doesn't change.
+  // An action that sets a run of nodes logs a single record for all count of them.
+  void log_change( name payer, name filename, uint8_t kind, uint64_t nodeid = 0, uint32_t count = 1 ) {
+    if ( ( filename.value & GEN_MASK ) != 0 )
+      return;
+    uint32_t window = get_config().feed_window.value();
+    if ( window == 0 )
+      return;
+    changes chs( _self, _self.value );
+    uint64_t seq = chs.available_primary_key();
+    chs.emplace( payer, [&]( auto& c ) {
+      c.seq = seq;
+      c.filename = filename;
+      c.kind = kind;
+      c.nodeid = nodeid;
+      c.count = count;
+    });
+    for ( uint32_t i = 0; i < FEED_PRUNE_LIMIT; ++i ) {
+      auto cit = chs.begin();
+      if ( cit->seq + window > seq )
+	break;
+      chs.erase( cit );
+    }
+  }
+
+  // Removes an erased file from the registry.
+  void unregister( name filename ) {
+    registry reg( _self, _self.value );
+    auto rit = reg.find( filename.value );
+    if ( rit != reg.end() )
+      reg.erase( rit );
   }
 
 };